@@ -9,10 +9,12 @@
 #include "postgres.h"
 #include "selector.h"
 #include "recipient.h"
+#include "blobstore.h"
 #include "transaction.h"
 #include "configuration.h"
 
 #include <stdio.h>
+#include <time.h>
 
 #define MSGBLOCKCOUNT	"1000"
 
@@ -33,7 +35,8 @@ static const char * versions[] = {
     "2.12", "2.13", "2.13", "2.14", "3.0.6", "3.1.0", // 76-81
     "3.1.0", "3.1.0", "3.1.0", "3.1.0", "3.1.0", "3.1.0", // 82-87
     "3.1.1", "3.1.3", "3.1.3", "3.1.3", "3.1.3", "3.2.0", // 88-93
-    "3.2.0", "3.2.0", "3.2.0", "3.2.0"
+    "3.2.0", "3.2.0", "3.2.0", "3.2.0", "3.2.0", "3.2.0",
+    "3.2.0", "3.2.0", "3.2.0", "3.2.0", "3.2.0", "3.2.0"
 };
 static int nv = sizeof( versions ) / sizeof( versions[0] );
 
@@ -145,7 +148,9 @@ f3( "vacuum", "", "Perform routine maintenance.",
     "    Synopsis: aox vacuum\n\n"
     "    Permanently deletes messages that were marked for deletion\n"
     "    more than a certain number of days ago (cf. undelete-time)\n"
-    "    and removes any bodyparts that are no longer used.\n\n"
+    "    and removes any bodyparts that are no longer used, including\n"
+    "    unused files in blob-directory. It also removes superseded\n"
+    "    entries from the log of message changes.\n\n"
     "    This is not a replacement for running VACUUM ANALYSE on the\n"
     "    database (either with vaccumdb or via autovacuum).\n\n"
     "    This command should be run (we suggest daily) via crontab.\n" );
@@ -230,6 +235,28 @@ void Vacuum::execute()
                     if (!q->done())
                         return;
                 } while (q->rows());
+                qstate = 5;
+                if ( BlobStore::enabled() ) {
+                    log( "vacuum: remove unused blobs", Log::Significant );
+                    q = new Query( "select hash from bodyparts where blob",
+                                   this );
+                    q->execute();
+                }
+            case 5:
+                if ( BlobStore::enabled() ) {
+                    if (!q->done())
+                        return;
+                    Dict<EString> used;
+                    while ( q->hasResults() ) {
+                        EString * h =
+                            new EString( q->nextRow()->getEString( "hash" ) );
+                        used.insert( *h, h );
+                    }
+                    uint n = BlobStore::removeUnused( used );
+                    if ( n )
+                        log( "vacuum: removed " + fn( n ) + " blobs",
+                             Log::Significant );
+                }
         }
 
         t = new Transaction( this );
@@ -278,6 +305,12 @@ void Vacuum::execute()
             t->enqueue( "drop index af_a" );
         }
 
+        log( "vacuum: compact mailbox_change_log", Log::Significant );
+        t->enqueue( "delete from mailbox_change_log c where not exists "
+                    "(select 1 from mailbox_messages mm "
+                    "where mm.mailbox=c.mailbox and mm.uid=c.uid "
+                    "and mm.modseq=c.modseq)" );
+
         Mailbox::setup( this );
         log( "vacuum: RetentionSelector", Log::Significant );
         r = new RetentionSelector( t, this );
@@ -773,3 +806,184 @@ void CheckDatabase::scream( class Query * q )
     error( "Unexpected row in the database. Contact info@aox.org. "
            "Query: " + q->string() + " Result row: " + rowSummary( q ) );
 }
+
+
+static AoxFactory<CheckBlobs>
+f7( "check", "blobs", "Check the files in blob-directory.",
+    "    Synopsis: aox check blobs\n\n"
+    "    Verifies that each bodypart stored in blob-directory exists\n"
+    "    and has the right length and MD5 hash, and reports those that\n"
+    "    are missing or damaged.\n\n"
+    "    This command reads every blob, so it can be slow.\n" );
+
+
+/*! \class CheckBlobs db.h
+
+    Checks that every bodypart stored in the blob-directory (see
+    BlobStore) can be read back intact.
+*/
+
+
+CheckBlobs::CheckBlobs( EStringList * args )
+    : AoxCommand( args ), q( 0 ), bad( 0 )
+{
+}
+
+
+void CheckBlobs::execute()
+{
+    if ( !q ) {
+        end();
+
+        if ( !BlobStore::enabled() ) {
+            printf( "blob-directory is not set.\n" );
+            finish();
+            return;
+        }
+
+        database();
+        q = new Query( "select hash, bytes from bodyparts where blob", this );
+        q->execute();
+    }
+
+    while ( q->hasResults() ) {
+        Row * r = q->nextRow();
+        EString hash = r->getEString( "hash" );
+        if ( !BlobStore::verify( hash, r->getInt( "bytes" ) ) ) {
+            printf( "Missing or damaged: %s\n",
+                    BlobStore::fileName( hash ).cstr() );
+            bad++;
+        }
+    }
+
+    if ( !q->done() )
+        return;
+
+    if ( bad )
+        error( fn( bad ) + " blobs are missing or damaged." );
+
+    finish();
+}
+
+
+class CompressBodypartsData
+    : public Garbage
+{
+public:
+    CompressBodypartsData()
+        : q( 0 ), t( 0 ), last( 0 ), started( 0 ),
+          rows( 0 ), compressed( 0 ), before( 0 ), after( 0 )
+    {}
+
+    Query * q;
+    Transaction * t;
+    uint last;
+    uint started;
+    uint rows;
+    uint compressed;
+    int64 before;
+    int64 after;
+};
+
+
+static AoxFactory<CompressBodyparts>
+f8( "compress", "bodyparts", "Compress stored bodyparts.",
+    "    Synopsis: aox compress bodyparts\n\n"
+    "    Compresses the data of HTML and non-text bodyparts that were\n"
+    "    stored before compress-bodyparts was enabled, a thousand rows\n"
+    "    at a time, so the servers can keep running meanwhile.\n\n"
+    "    When done, reports the compression ratio and throughput.\n" );
+
+
+/*! \class CompressBodyparts db.h
+
+    Compresses existing bodyparts.data in batches, using the same
+    criteria as the Injector does when compress-bodyparts is enabled,
+    and reports the ratio and throughput achieved.
+*/
+
+
+CompressBodyparts::CompressBodyparts( EStringList * args )
+    : AoxCommand( args ), d( new CompressBodypartsData )
+{
+}
+
+
+void CompressBodyparts::execute()
+{
+    if ( !d->started ) {
+        parseOptions();
+        end();
+        database( true );
+        d->started = time( 0 );
+    }
+
+    while ( true ) {
+        if ( d->t ) {
+            if ( !d->t->done() )
+                return;
+            if ( d->t->failed() ) {
+                error( "Could not compress bodyparts: " + d->t->error() );
+                return;
+            }
+            d->t = 0;
+        }
+
+        if ( !d->q ) {
+            d->q = new Query( "select id, data from bodyparts "
+                              "where id>$1 and data is not null "
+                              "and not compressed and not blob "
+                              "order by id limit 1000", this );
+            d->q->bind( 1, d->last );
+            d->q->execute();
+        }
+
+        if ( !d->q->done() )
+            return;
+
+        uint n = 0;
+        while ( d->q->hasResults() ) {
+            Row * r = d->q->nextRow();
+            EString data = r->getEString( "data" );
+            d->last = r->getInt( "id" );
+            d->rows++;
+            n++;
+            if ( data.length() <= 256 )
+                continue;
+            EString c = data.compressed();
+            if ( c.isEmpty() ||
+                 c.length() >= data.length() - data.length() / 8 )
+                continue;
+            Query * u = new Query( "update bodyparts "
+                                   "set data=$1, compressed=true "
+                                   "where id=$2 and not compressed", 0 );
+            u->bind( 1, c );
+            u->bind( 2, d->last );
+            if ( !d->t )
+                d->t = new Transaction( this );
+            d->t->enqueue( u );
+            d->compressed++;
+            d->before += data.length();
+            d->after += c.length();
+        }
+        d->q = 0;
+        if ( d->t )
+            d->t->commit();
+        else if ( !n )
+            break;
+    }
+
+    uint seconds = time( 0 ) - d->started;
+    if ( !seconds )
+        seconds = 1;
+    printf( "Compressed %d of %d bodyparts in %d seconds.\n",
+            d->compressed, d->rows, seconds );
+    if ( d->after )
+        printf( "Ratio %d.%02d:1 (%s to %s bytes), %s bytes/second.\n",
+                (int)( d->before / d->after ),
+                (int)( d->before * 100 / d->after % 100 ),
+                EString::humanNumber( d->before ).cstr(),
+                EString::humanNumber( d->after ).cstr(),
+                EString::humanNumber( d->before / seconds ).cstr() );
+    finish();
+}
@@ -85,4 +85,29 @@ private:
 };
 
 
+class CheckBlobs
+    : public AoxCommand
+{
+public:
+    CheckBlobs( EStringList * );
+    void execute();
+
+private:
+    class Query * q;
+    uint bad;
+};
+
+
+class CompressBodyparts
+    : public AoxCommand
+{
+public:
+    CompressBodyparts( EStringList * );
+    void execute();
+
+private:
+    class CompressBodypartsData * d;
+};
+
+
 #endif
@@ -7,6 +7,7 @@
 #include "message.h"
 #include "mailbox.h"
 #include "injector.h"
+#include "blobstore.h"
 #include "integerset.h"
 #include "transaction.h"
 
@@ -62,7 +63,8 @@ void Reparse::execute()
         d->q = new Query( "select mm.mailbox, mm.uid, mm.modseq, "
                           "mm.message as wrapper, "
                           "mb.nextmodseq, "
-                          "b.id as bodypart, b.text, b.data "
+                          "b.id as bodypart, b.text, b.data, "
+                          "b.compressed, b.blob, b.hash "
                           "from unparsed_messages u "
                           "join bodyparts b on (u.bodypart=b.id) "
                           "join part_numbers p on (p.bodypart=b.id) "
@@ -88,11 +90,27 @@ void Reparse::execute()
         Row * r = d->q->nextRow();
 
         EString text;
-        if ( r->isNull( "data" ) )
+        bool ok = true;
+        if ( r->getBoolean( "blob" ) ) {
+            // unparsable messages are usually large enough to be
+            // stored outside the database
+            if ( !BlobStore::contents( r->getEString( "hash" ), &text ) )
+                error( "Cannot read bodypart " +
+                       fn( r->getInt( "bodypart" ) ) +
+                       " from the blob store" );
+        }
+        else if ( r->isNull( "data" ) )
             text = r->getEString( "text" );
+        else if ( r->getBoolean( "compressed" ) )
+            text = r->getEString( "data" ).uncompressed( &ok );
         else
             text = r->getEString( "data" );
         Mailbox * mb = Mailbox::find( r->getInt( "mailbox" ) );
+        if ( !ok ) {
+            fprintf( stderr, "- cannot uncompress %s:%d, skipping\n",
+                     mb->name().utf8().cstr(), r->getInt( "uid" ) );
+            continue;
+        }
         Injectee * im = new Injectee;
         im->parse( text );
         if ( im->valid() ) {
@@ -104,6 +104,12 @@ void Exporter::execute()
         d->fetcher->execute();
     }
 
+    if ( d->fetcher->failed() ) {
+        log( "Could not fetch messages: " + d->fetcher->error(),
+             Log::Disaster );
+        return;
+    }
+
     while ( !d->messages->isEmpty() ) {
         Message * m = d->messages->firstElement();
         if ( !m->hasAddresses() )
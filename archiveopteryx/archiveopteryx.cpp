@@ -282,6 +282,11 @@ int main( int argc, char *argv[] )
         Configuration::StatisticsAddress, Configuration::StatisticsPort
     );
 
+    Listener< MetricsServer >::create(
+        "Metrics", Configuration::toggle( Configuration::UseMetrics ),
+        Configuration::MetricsAddress, Configuration::MetricsPort
+    );
+
     EventLoop::global()->setMemoryUsage(
         1024 * 1024 * Configuration::scalar( Configuration::MemoryLimit ) );
 
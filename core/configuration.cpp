@@ -164,7 +164,12 @@ static struct {
     { "smarthost-port", Configuration::SmartHostPort, 25 },
     { "statistics-port", Configuration::StatisticsPort, 17220 },
     { "ldap-server-port", Configuration::LdapServerPort, 390 },
-    { "memory-limit", Configuration::MemoryLimit, 64 }
+    { "memory-limit", Configuration::MemoryLimit, 64 },
+    { "blob-threshold", Configuration::BlobThreshold, 262144 },
+    { "fetch-batch-time", Configuration::FetchBatchTime, 6000 },
+    { "fetch-batch-memory", Configuration::FetchBatchMemory, 32 },
+    { "metrics-port", Configuration::MetricsPort, 17240 },
+    { "slow-command-threshold", Configuration::SlowCommandThreshold, 2000 }
 };
 
 
@@ -211,7 +216,10 @@ static struct {
     { "smarthost-address", Configuration::SmartHostAddress, "127.0.0.1" },
     { "address-separator", Configuration::AddressSeparator, "" },
     { "statistics-address", Configuration::StatisticsAddress, "127.0.0.1" },
-    { "ldap-server-address", Configuration::LdapServerAddress, "127.0.0.1" }
+    { "ldap-server-address", Configuration::LdapServerAddress, "127.0.0.1" },
+    { "blob-directory", Configuration::BlobDirectory, "" },
+    { "metrics-address", Configuration::MetricsAddress, "127.0.0.1" },
+    { "prewarm-mailboxes", Configuration::PrewarmMailboxes, "INBOX" }
 };
 
 
@@ -243,7 +251,10 @@ static struct {
     { "use-statistics", Configuration::UseStatistics, false },
     { "soft-bounce", Configuration::SoftBounce, true },
     { "check-sender-addresses", Configuration::CheckSenderAddresses, false },
-    { "use-imap-quota", Configuration::UseImapQuota, true }
+    { "use-imap-quota", Configuration::UseImapQuota, true },
+    { "compress-bodyparts", Configuration::CompressBodyparts, false },
+    { "group-flag-commits", Configuration::GroupFlagCommits, false },
+    { "use-metrics", Configuration::UseMetrics, false }
 };
 
 
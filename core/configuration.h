@@ -57,6 +57,11 @@ public:
         StatisticsPort,
         LdapServerPort,
         MemoryLimit,
+        BlobThreshold,
+        FetchBatchTime,
+        FetchBatchMemory,
+        MetricsPort,
+        SlowCommandThreshold,
         // additional scalars go ABOVE THIS LINE
         NumScalars
     };
@@ -102,6 +107,9 @@ public:
         AddressSeparator,
         StatisticsAddress,
         LdapServerAddress,
+        BlobDirectory,
+        MetricsAddress,
+        PrewarmMailboxes,
         // additional texts go ABOVE THIS LINE
         NumTexts
     };
@@ -134,6 +142,9 @@ public:
         SoftBounce,
         CheckSenderAddresses,
         UseImapQuota,
+        CompressBodyparts,
+        GroupFlagCommits,
+        UseMetrics,
         // additional toggles go ABOVE THIS LINE
         NumToggles
     };
@@ -8,6 +8,8 @@
 #include <stdio.h>
 // strlen
 #include <string.h>
+// deflate, inflate
+#include <zlib.h>
 
 
 /*! \class EStringData estring.h
@@ -1168,6 +1170,8 @@ EString EString::de64() const
 {
     // this code comes from mailchen, adapted for EString.
     EString result;
+    if ( !d || !d->len )
+        return result;
     result.reserve( length() * 3 / 4 + 20 ); // 20 = fudge
     EString body;
     uint bp = 0;
@@ -1175,7 +1179,26 @@ EString EString::de64() const
     int m = 0;
     uint p = 0;
     bool done = false;
+    const unsigned char * s = (const unsigned char *)d->str;
     while ( p < length() && !done ) {
+        // decode whole groups of four at a time, as long as there's
+        // no whitespace, padding or junk in the way. that's the bulk
+        // of any base64 body.
+        while ( m == 0 && p + 4 <= length() ) {
+            uint a = s[p] < 128 ? from64[s[p]] : 99;
+            uint b = s[p+1] < 128 ? from64[s[p+1]] : 99;
+            uint c = s[p+2] < 128 ? from64[s[p+2]] : 99;
+            uint e = s[p+3] < 128 ? from64[s[p+3]] : 99;
+            if ( ( a | b | c | e ) >= 64 )
+                break;
+            result.d->str[bp++] = ( a << 2 ) | ( b >> 4 );
+            result.d->str[bp++] = ( b << 4 ) | ( c >> 2 );
+            result.d->str[bp++] = ( c << 6 ) | e;
+            p += 4;
+        }
+        if ( p >= length() )
+            break;
+
         uint c = d->str[p++];
         if ( c <= 'z' )
             c = from64[c];
@@ -1274,6 +1297,18 @@ EString EString::e64( uint lineLength ) const
 }
 
 
+static uint hexDigit( char c )
+{
+    if ( c >= '0' && c <= '9' )
+        return c - '0';
+    if ( c >= 'a' && c <= 'f' )
+        return c - 'a' + 10;
+    if ( c >= 'A' && c <= 'F' )
+        return c - 'A' + 10;
+    return 16;
+}
+
+
 /*! Decodes this string according to the quoted-printable algorithm,
     and returns the result. Errors are overlooked, to cope with all
     the mail-munging brokenware in the great big world.
@@ -1288,7 +1323,16 @@ EString EString::deQP( bool underscore ) const
     EString r;
     r.reserve( length() );
     while ( i < length() ) {
-        if ( d->str[i] != '=' ) {
+        if ( !underscore && d->str[i] != '=' ) {
+            // copy everything up to the next '=' in one go
+            const char * e = (const char *)memchr( d->str + i, '=',
+                                                   d->len - i );
+            uint n = e ? e - ( d->str + i ) : d->len - i;
+            memmove( r.d->str + r.d->len, d->str + i, n );
+            r.d->len += n;
+            i += n;
+        }
+        else if ( d->str[i] != '=' ) {
             char c = d->str[i++];
             if ( underscore && c == '_' )
                 c = ' ';
@@ -1315,7 +1359,12 @@ EString EString::deQP( bool underscore ) const
             }
             else if ( i + 2 < d->len ) {
                 // ... and one common case: a two-digit hex number, not EOL
-                c = mid( i+1, 2 ).number( &ok, 16 );
+                uint h = hexDigit( d->str[i+1] );
+                uint l = hexDigit( d->str[i+2] );
+                if ( h < 16 && l < 16 ) {
+                    c = h * 16 + l;
+                    ok = true;
+                }
             }
 
             // write the proper decoded string and increase i.
@@ -1997,3 +2046,67 @@ void EString::replace( const EString & a, const EString & b )
         i = find( a, i + b.length() );
     }
 }
+
+
+/*! Returns a zlib-compressed copy of this string, as uncompressed()
+    expects it. The compression level is 6, which is zlib's default
+    and a reasonable compromise for text that's written once and read
+    many times.
+*/
+
+EString EString::compressed() const
+{
+    EString r;
+    z_stream zs;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+    if ( ::deflateInit( &zs, 6 ) != Z_OK )
+        return r;
+
+    uint max = ::deflateBound( &zs, length() );
+    r.reserve( max );
+    zs.next_in = (Bytef*)data();
+    zs.avail_in = length();
+    zs.next_out = (Bytef*)r.d->str;
+    zs.avail_out = max;
+    if ( ::deflate( &zs, Z_FINISH ) == Z_STREAM_END )
+        r.d->len = max - zs.avail_out;
+    ::deflateEnd( &zs );
+    return r;
+}
+
+
+/*! Returns an uncompressed copy of this string, which must have been
+    created by compressed(). If \a ok is non-null, *ok is set to true
+    if decompression succeeds and to false if the string is damaged.
+    The result may be truncated if the string is damaged.
+*/
+
+EString EString::uncompressed( bool * ok ) const
+{
+    EString r;
+    z_stream zs;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+    zs.next_in = (Bytef*)data();
+    zs.avail_in = length();
+    int z = ::inflateInit( &zs );
+
+    // text typically compresses 3-5x, so this is usually enough
+    r.reserve( length() * 4 + 128 );
+    while ( z == Z_OK ) {
+        if ( r.d->len == r.d->max )
+            r.reserve( r.d->max * 2 );
+        zs.next_out = (Bytef*)r.d->str + r.d->len;
+        zs.avail_out = r.d->max - r.d->len;
+        z = ::inflate( &zs, Z_NO_FLUSH );
+        r.d->len = r.d->max - zs.avail_out;
+    }
+    if ( z != Z_MEM_ERROR && z != Z_VERSION_ERROR )
+        ::inflateEnd( &zs );
+    if ( ok )
+        *ok = ( z == Z_STREAM_END );
+    return r;
+}
@@ -42,7 +42,7 @@ void log( const EString &m, Log::Severity s )
 /*! Constructs a Log object the parent() that's currently in Scope. */
 
 Log::Log()
-    : children( 1 ), p( 0 )
+    : children( 1 ), p( 0 ), sp( 0 )
 {
     Scope * cs = Scope::current();
     if ( cs )
@@ -57,7 +57,7 @@ Log::Log()
 /*! Constructs a Log object with parent() \a parent. */
 
 Log::Log( Log * parent )
-    : children( 0 ), p( parent )
+    : children( 0 ), p( parent ), sp( 0 )
 {
     if ( p )
         ide = p->id() + "/" + fn( p->children++ );
@@ -169,6 +169,25 @@ bool Log::isChildOf( Log * other ) const
 }
 
 
+/*! Returns the Span timing the command this Log belongs to, or a null
+    pointer if there isn't one. Span::find() looks through the parent()
+    chain as well.
+*/
+
+Span * Log::span() const
+{
+    return sp;
+}
+
+
+/*! Records that \a span is timing the work done using this Log. */
+
+void Log::setSpan( Span * span )
+{
+    sp = span;
+}
+
+
 /*! Sets \a s as the minimum severity messages must have to be logged.
 */
 
@@ -7,6 +7,7 @@
 #include "estring.h"
 
 class EString;
+class Span;
 
 
 class Log
@@ -23,6 +24,9 @@ public:
     Log * parent() const;
     bool isChildOf( Log * ) const;
 
+    Span * span() const;
+    void setSpan( Span * );
+
     static void setLogLevel( Severity );
     static const char * severity( Severity );
     static bool disastersYet();
@@ -31,6 +35,7 @@ private:
     EString ide;
     uint children;
     Log * p;
+    Span * sp;
 };
 
 
@@ -0,0 +1,224 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "span.h"
+
+#include "log.h"
+#include "list.h"
+#include "estring.h"
+#include "configuration.h"
+
+#include <sys/time.h> // gettimeofday, struct timeval
+
+
+static uint elapsed( const struct timeval & from, const struct timeval & to )
+{
+    int64 ms = ( to.tv_sec - from.tv_sec ) * (int64)1000 +
+               ( to.tv_usec - from.tv_usec ) / 1000;
+    if ( ms < 0 )
+        return 0;
+    return (uint)ms;
+}
+
+
+class SpanData
+    : public Garbage
+{
+public:
+    SpanData()
+        : log( 0 ), phase( 0 ), done( false ),
+          queries( 0 ), dbWait( 0 ), dbExecute( 0 )
+    {}
+
+    class Phase
+        : public Garbage
+    {
+    public:
+        Phase( const char * n ): name( n ), ms( 0 ) {}
+        const char * name;
+        uint ms;
+    };
+
+    Log * log;
+    EString what;
+    List<Phase> phases;
+    Phase * phase;
+    struct timeval started;
+    struct timeval entered;
+    bool done;
+
+    uint queries;
+    uint dbWait;
+    uint dbExecute;
+};
+
+
+/*! \class Span span.h
+    The Span class measures where the time goes while a single command
+    is processed.
+
+    A Span is created when a command is parsed and attached to the
+    command's Log. The command then calls enter() whenever it moves
+    from one phase to another (e.g. from "parse" to "execute"), and
+    each Query that runs on behalf of the command (i.e. with the
+    command's Log or one of its children) reports how long it waited
+    for a database connection and how long the server took to execute
+    it, using addQuery().
+
+    When the command is done, finish() logs a single line with the
+    breakdown if the command took longer than the
+    slow-command-threshold configuration setting, and nothing
+    otherwise. The per-command cost is therefore a few calls to
+    gettimeofday().
+*/
+
+
+/*! Constructs a Span describing \a what, starts timing it and
+    attaches it to \a log, so that find() can locate it later. \a log
+    may not be 0.
+*/
+
+Span::Span( Log * log, const EString & what )
+    : d( new SpanData )
+{
+    d->log = log;
+    d->what = what;
+    (void)::gettimeofday( &d->started, 0 );
+    d->entered = d->started;
+    if ( log )
+        log->setSpan( this );
+}
+
+
+/*! Records that the command moves into \a phase, and charges the time
+    since the last call to the previous phase. Phases may be entered
+    repeatedly; the times are summed. Entering the current phase again
+    does nothing.
+
+    \a phase must be a string constant.
+*/
+
+void Span::enter( const char * phase )
+{
+    if ( d->done )
+        return;
+    if ( d->phase && d->phase->name == phase )
+        return;
+
+    struct timeval now;
+    (void)::gettimeofday( &now, 0 );
+    if ( d->phase )
+        d->phase->ms += elapsed( d->entered, now );
+    d->entered = now;
+
+    List<SpanData::Phase>::Iterator i( d->phases );
+    while ( i && i->name != phase )
+        ++i;
+    if ( i ) {
+        d->phase = i;
+    }
+    else {
+        d->phase = new SpanData::Phase( phase );
+        d->phases.append( d->phase );
+    }
+}
+
+
+/*! Records that a Query ran on behalf of this command, having waited
+    \a wait milliseconds for a database connection and then spent \a
+    execute milliseconds being executed.
+*/
+
+void Span::addQuery( uint wait, uint execute )
+{
+    if ( d->done )
+        return;
+    d->queries++;
+    d->dbWait += wait;
+    d->dbExecute += execute;
+}
+
+
+/*! Stops timing and, if the command took at least as long as the
+    slow-command-threshold setting, logs the breakdown. Subsequent
+    calls do nothing.
+*/
+
+void Span::finish()
+{
+    if ( d->done )
+        return;
+    enter( "" );
+    d->done = true;
+    if ( d->log && d->log->span() == this )
+        d->log->setSpan( 0 );
+
+    uint threshold =
+        Configuration::scalar( Configuration::SlowCommandThreshold );
+    uint total = milliseconds();
+    if ( !threshold || total < threshold )
+        return;
+
+    EString s( "Slow command: " );
+    s.append( d->what );
+    s.append( " total=" );
+    s.appendNumber( total );
+    s.append( "ms" );
+    List<SpanData::Phase>::Iterator i( d->phases );
+    while ( i ) {
+        if ( i->name[0] ) {
+            s.append( " " );
+            s.append( i->name );
+            s.append( "=" );
+            s.appendNumber( i->ms );
+            s.append( "ms" );
+        }
+        ++i;
+    }
+    s.append( " queries=" );
+    s.appendNumber( d->queries );
+    if ( d->queries ) {
+        s.append( " db-wait=" );
+        s.appendNumber( d->dbWait );
+        s.append( "ms db-execute=" );
+        s.appendNumber( d->dbExecute );
+        s.append( "ms" );
+    }
+    d->log->log( s, Log::Significant );
+}
+
+
+/*! Returns true if finish() has been called, and false if not. */
+
+bool Span::finished() const
+{
+    return d->done;
+}
+
+
+/*! Returns the number of milliseconds since this Span was created, or
+    the total duration if it has finished.
+*/
+
+uint Span::milliseconds() const
+{
+    if ( d->done )
+        return elapsed( d->started, d->entered );
+    struct timeval now;
+    (void)::gettimeofday( &now, 0 );
+    return elapsed( d->started, now );
+}
+
+
+/*! Returns the unfinished Span attached to \a log or its nearest
+    parent, or a null pointer if there isn't any.
+*/
+
+Span * Span::find( Log * log )
+{
+    while ( log ) {
+        if ( log->span() )
+            return log->span();
+        log = log->parent();
+    }
+    return 0;
+}
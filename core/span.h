@@ -0,0 +1,32 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef SPAN_H
+#define SPAN_H
+
+#include "global.h"
+
+class EString;
+class Log;
+
+
+class Span
+    : public Garbage
+{
+public:
+    Span( Log *, const EString & );
+
+    void enter( const char * );
+    void addQuery( uint, uint );
+    void finish();
+
+    bool finished() const;
+    uint milliseconds() const;
+
+    static Span * find( Log * );
+
+private:
+    class SpanData * d;
+};
+
+
+#endif
@@ -14,9 +14,11 @@
 /*! \class UStringData ustring.h
 
     This private helper class contains the actual string data. It has
-    three fields, all accessible only to UString. The only noteworthy
-    field is max, which is 0 in the case of a shared/read-only string,
-    and nonzero in the case of a string which can be modified.
+    four fields, all accessible only to UString. max is 0 in the case
+    of a shared/read-only string, and nonzero in the case of a string
+    which can be modified. wide is true if str holds one uint per
+    character, and false if it holds one byte per character, which is
+    possible as long as all code points are at most U+00FF.
 */
 
 
@@ -28,16 +30,16 @@
 /*! Creates a new EString with \a words capacity. */
 
 UStringData::UStringData( int words )
-    : str( 0 ), len( 0 ), max( words )
+    : str( 0 ), len( 0 ), max( words ), wide( false )
 {
     if ( str )
-        str = (uint*)Allocator::alloc( words*sizeof(uint), 0 );
+        str = Allocator::alloc( words*sizeof(uint), 0 );
 }
 
 
 void * UStringData::operator new( size_t ownSize, uint extra )
 {
-    return Allocator::alloc( ownSize + extra*sizeof(uint), 1 );
+    return Allocator::alloc( ownSize + extra, 1 );
 }
 
 
@@ -62,6 +64,13 @@ void * UStringData::operator new( size_t ownSize, uint extra )
     ASCII, returning false for every unprintable or non-ASCII
     character. Very useful for comparing a UString to e.g. "seen" or
     ".", but nothing more.
+
+    Most strings (mailbox names, addresses, subjects in western
+    languages) contain only code points up to U+00FF, so UString
+    stores one byte per character until a larger code point is
+    appended, and only then widens its storage to one uint per
+    character. This is invisible to users of the class, except that
+    data() may have to widen the string.
 */
 
 
@@ -181,8 +190,22 @@ void UString::append( const UString & other )
         *this = other;
         return;
     }
-    reserve( length() + other.length() );
-    memmove( d->str+d->len, other.d->str, sizeof(uint)*other.d->len );
+    if ( other.d->wide && !d->wide )
+        reserve2( length() + other.length(), true );
+    else
+        reserve( length() + other.length() );
+    if ( d->wide == other.d->wide ) {
+        uint si = d->wide ? sizeof( uint ) : 1;
+        memmove( (char*)d->str + si*d->len, other.d->str, si*other.d->len );
+    }
+    else {
+        uint * t = (uint*)d->str + d->len;
+        uint i = 0;
+        while ( i < other.d->len ) {
+            t[i] = other.d->at( i );
+            i++;
+        }
+    }
     d->len += other.d->len;
 }
 
@@ -191,8 +214,11 @@ void UString::append( const UString & other )
 
 void UString::append( const uint cp )
 {
-    reserve( length() + 1 );
-    d->str[d->len] = cp;
+    if ( cp > 255 && ( !d || !d->wide ) )
+        reserve2( d && d->max > length() ? d->max : length() + 1, true );
+    else
+        reserve( length() + 1 );
+    d->set( d->len, cp );
     d->len++;
 }
 
@@ -206,8 +232,34 @@ void UString::append( const char * s )
     if ( !s || !*s )
         return;
     reserve( length() + strlen( s ) );
-    while ( s && *s )
-        d->str[d->len++] = (uint)*s++; // I feel naughty today
+    while ( s && *s ) {
+        uint c = (uint)*s++; // I feel naughty today
+        if ( c > 255 && !d->wide )
+            reserve2( d->max, true );
+        d->set( d->len++, c );
+    }
+}
+
+
+/*! Appends the \a n bytes at \a s to the end of this string,
+    treating each byte as an ISO-8859-1 character. Unlike
+    append( const char * ), this copies embedded nulls, and copies all
+    \a n bytes at once if the string stores one byte per character.
+*/
+
+void UString::append( const char * s, uint n )
+{
+    if ( !s || !n )
+        return;
+    reserve( length() + n );
+    if ( !d->wide ) {
+        memmove( (char*)d->str + d->len, s, n );
+        d->len += n;
+        return;
+    }
+    uint i = 0;
+    while ( i < n )
+        d->set( d->len++, (unsigned char)s[i++] );
 }
 
 
@@ -221,37 +273,51 @@ void UString::reserve( uint num )
     if ( !num )
         num = 1;
     if ( !d || d->max < num )
-        reserve2( num );
+        reserve2( num, d && d->wide );
 }
 
 
-/*! Equivalent to reserve(). reserve( \a num ) calls this function to
-    do the heavy lifting. This function is not inline, while reserve()
-    is, and calls to this function should be interesting wrt. memory
-    allocation statistics.
+/*! Equivalent to reserve(), except that the new storage holds one
+    uint per character if \a wide is true, and one byte otherwise.
+    reserve( \a num ) calls this function to do the heavy lifting, and
+    append() calls it to widen the string. This function is not
+    inline, while reserve() is, and calls to this function should be
+    interesting wrt. memory allocation statistics.
 
-    Noone except reserve() should call reserve2().
+    Noone except reserve(), append() and titlecased() should call
+    reserve2(), and none of them may narrow a wide string.
 */
 
-void UString::reserve2( uint num )
+void UString::reserve2( uint num, bool wide )
 {
     const uint std = sizeof( UStringData );
-    const uint si = sizeof( uint );
+    const uint si = wide ? sizeof( uint ) : 1;
     num = ( Allocator::rounded( num * si + std ) - std ) / si;
 
     UStringData * freeable = 0;
     if ( d && d->max )
         freeable = d;
 
-    UStringData * nd = new( num ) UStringData( 0 );
+    UStringData * nd = new( num * si ) UStringData( 0 );
     nd->max = num;
-    nd->str = (uint*)(std + (char*)nd);
+    nd->wide = wide;
+    nd->str = std + (char*)nd;
     if ( d )
         nd->len = d->len;
     if ( nd->len > num )
         nd->len = num;
-    if ( d && d->len )
-        memmove( nd->str, d->str, nd->len*si );
+    if ( d && d->len ) {
+        if ( d->wide == wide ) {
+            memmove( nd->str, d->str, nd->len*si );
+        }
+        else {
+            uint i = 0;
+            while ( i < nd->len ) {
+                nd->set( i, d->at( i ) );
+                i++;
+            }
+        }
+    }
     d = nd;
 
     if ( freeable )
@@ -284,9 +350,8 @@ bool UString::isAscii() const
         return true;
     uint i = 0;
     while ( i < d->len ) {
-        if ( d->str[i] >= 128 ||
-             ( d->str[i] < 32 &&
-               d->str[i] != 9 && d->str[i] != 10 && d->str[i] != 13 ) )
+        uint c = d->at( i );
+        if ( c >= 128 || ( c < 32 && c != 9 && c != 10 && c != 13 ) )
             return false;
         i++;
     }
@@ -310,8 +375,9 @@ EString UString::ascii() const
     r.reserve( length() );
     uint i = 0;
     while ( i < length() ) {
-        if ( d->str[i] >= ' ' && d->str[i] < 127 )
-            r.append( (char)(d->str[i]) );
+        uint c = d->at( i );
+        if ( c >= ' ' && c < 127 )
+            r.append( (char)c );
         else
             r.append( '?' );
         i++;
@@ -342,8 +408,9 @@ UString UString::mid( uint start, uint num ) const
 
     d->max = 0;
     result.d = new UStringData;
-    result.d->str = d->str + start;
+    result.d->str = (char*)d->str + start * ( d->wide ? sizeof( uint ) : 1 );
     result.d->len = num;
+    result.d->wide = d->wide;
     return result;
 }
 
@@ -395,7 +462,7 @@ UString UString::simplified() const
     uint i = 0;
     uint first = 0;
     while ( i < length() && first == i ) {
-        if ( isSpace( d->str[i] ) )
+        if ( isSpace( d->at( i ) ) )
             first++;
         i++;
     }
@@ -407,7 +474,7 @@ UString UString::simplified() const
     uint spaces = 0;
     bool identity = true;
     while ( identity && i < length() ) {
-        if ( isSpace( d->str[i] ) ) {
+        if ( isSpace( d->at( i ) ) ) {
             spaces++;
         }
         else {
@@ -428,7 +495,7 @@ UString UString::simplified() const
     bool ogham = false;
     bool zwnbsp = true;
     while ( i < length() ) {
-        int c = d->str[i];
+        int c = d->at( i );
         if ( isSpace( c ) ) {
             if ( c == 0x1680 )
                 ogham = true;
@@ -466,7 +533,7 @@ UString UString::trimmed() const
     uint first = length();
     uint last = 0;
     while ( i < length() ) {
-        if ( !isSpace( d->str[i] ) ) {
+        if ( !isSpace( d->at( i ) ) ) {
             if ( i < first )
                 first = i;
             if ( i > last )
@@ -513,7 +580,7 @@ int UString::compare( const UString & other ) const
         return 0;
     uint i = 0;
     while ( i < length() && i < other.length() &&
-            d->str[i] == other.d->str[i] )
+            d->at( i ) == other.d->at( i ) )
         i++;
     if ( i >= length() && i >= other.length() )
         return 0;
@@ -521,7 +588,7 @@ int UString::compare( const UString & other ) const
         return -1;
     if ( i >= other.length() )
         return 1;
-    if ( d->str[i] < other.d->str[i] )
+    if ( d->at( i ) < other.d->at( i ) )
         return -1;
     return 1;
 }
@@ -573,7 +640,7 @@ bool UString::startsWith( const char * prefix ) const
     if ( !length() )
         return false;
     uint i = 0;
-    while ( i < d->len && prefix[i] && prefix[i] == d->str[i] )
+    while ( i < d->len && prefix[i] && prefix[i] == d->at( i ) )
         i++;
     if ( i > d->len )
         return false;
@@ -606,7 +673,7 @@ bool UString::endsWith( const char * suffix ) const
     if ( l > length() )
         return false;
     uint i = 0;
-    while ( i < l && suffix[i] == d->str[d->len - l + i] )
+    while ( i < l && suffix[i] == d->at( d->len - l + i ) )
         i++;
     if ( i < l )
         return false;
@@ -620,7 +687,7 @@ bool UString::endsWith( const char * suffix ) const
 
 int UString::find( char c, int i ) const
 {
-    while ( i < (int)length() && d->str[i] != c )
+    while ( i < (int)length() && d->at( i ) != (uint)c )
         i++;
     if ( i < (int)length() )
         return i;
@@ -636,7 +703,7 @@ int UString::find( const UString & s, int i ) const
 {
     uint j = 0;
     while ( j < s.length() && i+j < length() ) {
-        if ( d->str[i+j] == s.d->str[j] ) {
+        if ( d->at( i+j ) == s.d->at( j ) ) {
             j++;
         }
         else {
@@ -681,7 +748,7 @@ bool UString::contains( const char * s ) const
         uint l = strlen( s );
         uint j = 0;
         while ( j < l && i + j < length() &&
-                d->str[i+j] == s[j] )
+                d->at( i+j ) == (uint)s[j] )
             j++;
         if ( j == l )
             return true;
@@ -694,6 +761,33 @@ bool UString::contains( const char * s ) const
 #include "unicode-titlecase.inc"
 
 
+/*! Returns a pointer to the characters of this string, one uint per
+    character, or a null pointer if the string is empty and has never
+    had any storage. If the string stores one byte per character, this
+    function widens it first, which costs memory.
+*/
+
+const uint * UString::data() const
+{
+    if ( !d )
+        return 0;
+    if ( !d->wide ) {
+        uint * w = 0;
+        if ( d->len )
+            w = (uint*)Allocator::alloc( d->len * sizeof( uint ), 0 );
+        uint i = 0;
+        while ( i < d->len ) {
+            w[i] = d->at( i );
+            i++;
+        }
+        d->str = w;
+        d->max = 0;
+        d->wide = true;
+    }
+    return (const uint*)d->str;
+}
+
+
 /*! Returns a titlecased version of this string. Usable for
     case-insensitive comparison, not much else.
 */
@@ -703,12 +797,14 @@ UString UString::titlecased() const
     UString r = *this;
     uint i = 0;
     while ( i < length() ) {
-        uint cp = d->str[i];
+        uint cp = d->at( i );
         if ( cp < numTitlecaseCodepoints &&
              titlecaseCodepoints[cp] &&
              cp != titlecaseCodepoints[cp] ) {
             r.detach();
-            r.d->str[i] = titlecaseCodepoints[cp];
+            if ( titlecaseCodepoints[cp] > 255 && !r.d->wide )
+                r.reserve2( r.length(), true );
+            r.d->set( i, titlecaseCodepoints[cp] );
         }
         i++;
     }
@@ -12,7 +12,7 @@ class UStringData
     : public Garbage
 {
 private:
-    UStringData(): str( 0 ), len( 0 ), max( 0 ) {
+    UStringData(): str( 0 ), len( 0 ), max( 0 ), wide( false ) {
         setFirstNonPointer( &len );
     }
     UStringData( int );
@@ -23,9 +23,22 @@ private:
     void * operator new( size_t, uint );
     void * operator new( size_t s ) { return Garbage::operator new( s); }
 
-    uint * str;
+    uint at( uint i ) const {
+        if ( wide )
+            return ((const uint *)str)[i];
+        return ((const unsigned char *)str)[i];
+    }
+    void set( uint i, uint c ) {
+        if ( wide )
+            ((uint *)str)[i] = c;
+        else
+            ((unsigned char *)str)[i] = (unsigned char)c;
+    }
+
+    void * str;
     uint len;
     uint max;
+    bool wide;
 };
 
 
@@ -46,7 +59,7 @@ public:
     uint operator[]( uint i ) const {
         if ( !d || i >= d->len )
             return 0;
-        return d->str[i];
+        return d->at( i );
     }
 
     bool isEmpty() const { return !d || d->len == 0; }
@@ -55,6 +68,7 @@ public:
     void append( const UString & );
     void append( const uint );
     void append( const char * );
+    void append( const char *, uint );
 
     void reserve( uint );
     void truncate( uint = 0 );
@@ -77,7 +91,7 @@ public:
     UString simplified() const;
     UString trimmed() const;
 
-    inline const uint * data() const { return d ? (const uint*)d->str : 0; }
+    const uint * data() const;
 
     UString titlecased() const;
 
@@ -104,10 +118,11 @@ public:
     static bool isSpace( uint );
 
 private:
-    void reserve2( uint );
+    void reserve2( uint, bool );
 
 
 private:
+    friend bool operator==( const UString &, const UString & );
     class UStringData * d;
 };
 
@@ -117,6 +132,16 @@ inline bool operator==( const UString & s1, const UString & s2 )
     if ( s1.length() != s2.length() )
         return false;
     uint i = 0;
+    if ( s1.d && s2.d && !s1.d->wide && !s2.d->wide ) {
+        const unsigned char * a = (const unsigned char *)s1.d->str;
+        const unsigned char * b = (const unsigned char *)s2.d->str;
+        while ( i < s1.d->len ) {
+            if ( a[i] != b[i] )
+                return false;
+            i++;
+        }
+        return true;
+    }
     while ( i < s1.length() ) {
         if ( s1[i] != s2[i] )
             return false;
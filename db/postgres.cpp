@@ -1121,6 +1121,10 @@ bool Postgres::usable() const
 
 static GraphableCounter * goodQueries = 0;
 static GraphableCounter * badQueries = 0;
+static GraphableHistogram * queryTimes[6];
+static const char * statements[6] = {
+    "select", "insert", "update", "delete", "copy", "other"
+};
 
 
 /*! Updates the statistics when \a q is done. */
@@ -1138,8 +1142,16 @@ void Postgres::countQueries( class Query * q )
         badQueries->tick();
     ; // a query which fails but canFail is not counted anywhere.
 
-    // later also use GraphableDataSet to keep track of query
-    // execution times, but not right now.
+    EString s = q->string().section( " ", 1 ).lower();
+    uint i = 0;
+    while ( i < 5 && s != statements[i] )
+        i++;
+    if ( !queryTimes[i] )
+        queryTimes[i] =
+            GraphableHistogram::find( "db-query-milliseconds",
+                                      EString( "statement=\"" ) +
+                                      statements[i] + "\"" );
+    queryTimes[i]->addValue( q->milliseconds() );
 }
 
 
@@ -3,6 +3,7 @@
 #include "query.h"
 
 #include "log.h"
+#include "span.h"
 #include "utf.h"
 #include "event.h"
 #include "scope.h"
@@ -15,6 +16,8 @@
 #include "estringlist.h"
 #include "transaction.h"
 
+#include <sys/time.h> // gettimeofday, struct timeval
+
 
 class QueryData
     : public Garbage
@@ -24,8 +27,13 @@ public:
         : state( Query::Inactive ), format( Query::Text ),
           values( new Query::InputLine ), inputLines( 0 ),
           transaction( 0 ), owner( 0 ), totalRows( 0 ),
-          canFail( false )
-    {}
+          canFail( false ), span( 0 )
+    {
+        submitted.tv_sec = 0;
+        submitted.tv_usec = 0;
+        started.tv_sec = 0;
+        started.tv_usec = 0;
+    }
 
     Query::State state;
     Query::Format format;
@@ -45,6 +53,10 @@ public:
 
     bool canFail;
     bool canBeSlow;
+
+    Span * span;
+    struct timeval submitted;
+    struct timeval started;
 };
 
 
@@ -137,14 +149,64 @@ Query::State Query::state() const
 }
 
 
+static uint elapsed( const struct timeval & from, const struct timeval & to )
+{
+    if ( !from.tv_sec )
+        return 0;
+    int64 ms = ( to.tv_sec - from.tv_sec ) * (int64)1000 +
+               ( to.tv_usec - from.tv_usec ) / 1000;
+    if ( ms < 0 )
+        return 0;
+    return (uint)ms;
+}
+
+
 /*! Sets the state of this object to \a s.
     The initial state of each Query is Inactive, and the Database changes
     it to indicate the query's progress.
+
+    If the query runs on behalf of a command that's being timed by a
+    Span, the time spent waiting for a database handle and executing
+    is reported to that Span when the query completes or fails.
 */
 
 void Query::setState( State s )
 {
     d->state = s;
+    if ( s == Submitted ) {
+        (void)::gettimeofday( &d->submitted, 0 );
+        Log * l = 0;
+        if ( d->owner )
+            l = d->owner->log();
+        if ( !l && Scope::current() )
+            l = Scope::current()->log();
+        d->span = Span::find( l );
+    }
+    else if ( s == Executing ) {
+        (void)::gettimeofday( &d->started, 0 );
+    }
+    else if ( ( s == Completed || s == Failed ) && d->span ) {
+        struct timeval now;
+        (void)::gettimeofday( &now, 0 );
+        if ( d->started.tv_sec )
+            d->span->addQuery( elapsed( d->submitted, d->started ),
+                               elapsed( d->started, now ) );
+        else
+            d->span->addQuery( elapsed( d->submitted, now ), 0 );
+        d->span = 0;
+    }
+}
+
+
+/*! Returns the number of milliseconds since this Query was sent to
+    the server, or 0 if it hasn't been sent yet.
+*/
+
+uint Query::milliseconds() const
+{
+    struct timeval now;
+    (void)::gettimeofday( &now, 0 );
+    return elapsed( d->started, now );
 }
 
 
@@ -937,6 +999,26 @@ EStringList * Row::columnNames() const
 }
 
 
+/*! Returns the approximate number of bytes of data in this Row: The
+    length of each text or bytea column, and eight bytes for each
+    other column.
+*/
+
+uint Row::size() const
+{
+    uint n = 0;
+    uint i = 0;
+    while ( i < layout->count ) {
+        if ( data[i].type == Column::Bytes )
+            n += data[i].s.length();
+        else
+            n += 8;
+        i++;
+    }
+    return n;
+}
+
+
 /*! \class PreparedStatement query.h
     This class represents an SQL prepared statement.
 
@@ -31,6 +31,7 @@ public:
     };
     void setState( State );
     State state() const;
+    uint milliseconds() const;
     bool failed() const;
     bool done() const;
 
@@ -158,6 +159,8 @@ public:
 
     EStringList * columnNames() const;
 
+    uint size() const;
+
 private:
     const Column * data;
     const class PgRowDescription * layout;
@@ -592,6 +592,22 @@ bool Schema::singleStep()
         c = stepTo97(); break;
     case 97:
         c = stepTo98(); break;
+    case 98:
+        c = stepTo99(); break;
+    case 99:
+        c = stepTo100(); break;
+    case 100:
+        c = stepTo101(); break;
+    case 101:
+        c = stepTo102(); break;
+    case 102:
+        c = stepTo103(); break;
+    case 103:
+        c = stepTo104(); break;
+    case 104:
+        c = stepTo105(); break;
+    case 105:
+        c = stepTo106(); break;
     default:
         d->l->log( "Internal error. Reached impossible revision " +
                    fn( d->revision ) + ".", Log::Disaster );
@@ -4420,3 +4436,244 @@ bool Schema::stepTo98()
     d->t->enqueue( "alter table mailboxes add flag text" );
     return true;
 }
+
+
+/*! Records which bodyparts are stored in the blob-directory. */
+
+bool Schema::stepTo99()
+{
+    describeStep( "Adding support for externally stored bodyparts." );
+    d->t->enqueue( "alter table bodyparts "
+                   "add blob boolean not null default false" );
+    return true;
+}
+
+
+/*! Records which bodyparts have compressed data. */
+
+bool Schema::stepTo100()
+{
+    describeStep( "Adding support for compressed bodyparts." );
+    d->t->enqueue( "alter table bodyparts "
+                   "add compressed boolean not null default false" );
+    return true;
+}
+
+
+/*! Adds message_structures, which stores the ENVELOPE, BODY and
+    BODYSTRUCTURE strings for each message.
+*/
+
+bool Schema::stepTo101()
+{
+    describeStep( "Adding message_structures for ENVELOPE/BODYSTRUCTURE." );
+    d->t->enqueue( "create table message_structures ("
+                   "message integer primary key "
+                   "references messages(id) on delete cascade, "
+                   "envelope text not null, "
+                   "body text not null, "
+                   "bodystructure text not null)" );
+    d->t->enqueue( "grant select, insert on message_structures "
+                   "to " + d->dbuser );
+    return true;
+}
+
+
+/*! Adds mailboxes.change, which is set from a sequence whenever a
+    mailbox row changes, so that servers can reread only the mailboxes
+    that changed.
+*/
+
+bool Schema::stepTo102()
+{
+    describeStep( "Recording changes to mailboxes for incremental reads." );
+    d->t->enqueue( "create sequence mailbox_changes" );
+    d->t->enqueue( "alter table mailboxes add change bigint not null "
+                   "default nextval('mailbox_changes')" );
+    d->t->enqueue( "create index mb_change on mailboxes(change)" );
+    d->t->enqueue( "create function set_mailbox_change() "
+                   "returns trigger as $$"
+                   "begin "
+                   "new.change:=nextval('mailbox_changes'); "
+                   "return new; "
+                   "end;$$ language 'plpgsql'" );
+    d->t->enqueue( "create trigger mailbox_change_trigger "
+                   "before update on mailboxes for each "
+                   "row execute procedure set_mailbox_change()" );
+    d->t->enqueue( "grant select, update on mailbox_changes "
+                   "to " + d->dbuser );
+    return true;
+}
+
+
+/*! Installs triggers to tell the servers when permissions, groups or
+    group_members change, so that they can cache ACLs.
+*/
+
+bool Schema::stepTo103()
+{
+    describeStep( "Notifying servers when permissions change." );
+    d->t->enqueue( "create function notify_permissions() "
+                   "returns trigger as $$ "
+                   "begin "
+                   "notify permissions_updated; return NULL; "
+                   "end;$$ language 'plpgsql'" );
+    d->t->enqueue( "create trigger permissions_trigger "
+                   "after insert or update or delete "
+                   "on permissions "
+                   "for each statement "
+                   "execute procedure notify_permissions()" );
+    d->t->enqueue( "create trigger groups_trigger "
+                   "after insert or update or delete "
+                   "on groups "
+                   "for each statement "
+                   "execute procedure notify_permissions()" );
+    d->t->enqueue( "create trigger group_members_trigger "
+                   "after insert or update or delete "
+                   "on group_members "
+                   "for each statement "
+                   "execute procedure notify_permissions()" );
+    return true;
+}
+
+
+/*! Adds mailbox_counts, which a trigger keeps up to date as
+    mailbox_messages changes, so that STATUS needn't count messages.
+*/
+
+bool Schema::stepTo104()
+{
+    describeStep( "Adding mailbox_counts for STATUS." );
+    d->t->enqueue( "create table mailbox_counts ("
+                   "mailbox integer not null "
+                   "references mailboxes(id) on delete cascade, "
+                   "messages integer not null, "
+                   "unseen integer not null)" );
+    d->t->enqueue( "create index mc_m on mailbox_counts(mailbox)" );
+    d->t->enqueue( "insert into mailbox_counts (mailbox, messages, unseen) "
+                   "select mailbox, count(*), "
+                   "sum(case when seen then 0 else 1 end) "
+                   "from mailbox_messages group by mailbox" );
+    d->t->enqueue( "create function count_mailbox_messages() "
+                   "returns trigger as $$"
+                   "begin "
+                   "if tg_op='INSERT' then "
+                   "insert into mailbox_counts (mailbox, messages, unseen) "
+                   "values (new.mailbox, 1, "
+                   "case when new.seen then 0 else 1 end); "
+                   "elsif tg_op='DELETE' then "
+                   "insert into mailbox_counts (mailbox, messages, unseen) "
+                   "select id, -1, case when old.seen then 0 else -1 end "
+                   "from mailboxes where id=old.mailbox; "
+                   "elsif old.mailbox<>new.mailbox then "
+                   "insert into mailbox_counts (mailbox, messages, unseen) "
+                   "values (old.mailbox, -1, "
+                   "case when old.seen then 0 else -1 end), "
+                   "(new.mailbox, 1, "
+                   "case when new.seen then 0 else 1 end); "
+                   "elsif old.seen<>new.seen then "
+                   "insert into mailbox_counts (mailbox, messages, unseen) "
+                   "values (new.mailbox, 0, "
+                   "case when new.seen then -1 else 1 end); "
+                   "end if; "
+                   "return NULL; "
+                   "end;$$ language 'plpgsql' security definer" );
+    d->t->enqueue( "create trigger mailbox_messages_count_trigger "
+                   "after insert or update of mailbox, seen or delete "
+                   "on mailbox_messages "
+                   "for each row "
+                   "execute procedure count_mailbox_messages()" );
+    d->t->enqueue( "grant select, insert, delete on mailbox_counts "
+                   "to " + d->dbuser );
+    return true;
+}
+
+
+/*! Adds "on update cascade" to the flags and annotations references
+    to mailbox_messages, so that MOVE can renumber messages in place.
+*/
+
+bool Schema::stepTo105()
+{
+    if ( d->substate == 0 ) {
+        describeStep( "Letting flags and annotations follow moved messages." );
+        // the names depend on how the database was created
+        d->q = new Query( "select d.relname::text,c.conname::text "
+                          "from pg_constraint c join pg_class d "
+                          "on (c.conrelid=d.oid) join pg_class e "
+                          "on (c.confrelid=e.oid) where c.contype='f' "
+                          "and e.relname='mailbox_messages' "
+                          "and d.relname in ('flags','annotations')", this );
+        d->t->enqueue( d->q );
+        d->t->execute();
+        d->substate = 1;
+    }
+
+    if ( d->substate == 1 ) {
+        if ( !d->q->done() )
+            return false;
+
+        Dict<EString> constraints;
+        while ( d->q->hasResults() ) {
+            Row * r = d->q->nextRow();
+            constraints.insert( r->getEString( "relname" ),
+                                new EString( r->getEString( "conname" ) ) );
+        }
+
+        const char * tables[] = { "flags", "annotations", 0 };
+        uint i = 0;
+        while ( tables[i] ) {
+            EString table( tables[i] );
+            EString * name = constraints.find( table );
+            EString constraint( table + "_mailbox_fkey" );
+            if ( name ) {
+                constraint = name->quoted();
+                d->t->enqueue( "alter table " + table +
+                               " drop constraint " + constraint );
+            }
+            d->t->enqueue( "alter table " + table + " add constraint " +
+                           constraint + " foreign key "
+                           "(mailbox,uid) references "
+                           "mailbox_messages (mailbox,uid) "
+                           "on update cascade on delete cascade" );
+            i++;
+        }
+    }
+
+    return true;
+}
+
+
+/*! Adds mailbox_change_log, which lets CONDSTORE and QRESYNC
+    find changed messages without reading all of a mailbox's
+    mailbox_messages rows.
+*/
+
+bool Schema::stepTo106()
+{
+    describeStep( "Adding mailbox_change_log for CONDSTORE and QRESYNC." );
+    d->t->enqueue( "create table mailbox_change_log ("
+                   "mailbox integer not null "
+                   "references mailboxes(id) on delete cascade, "
+                   "uid integer not null, "
+                   "modseq bigint not null)" );
+    d->t->enqueue( "insert into mailbox_change_log (mailbox, uid, modseq) "
+                   "select mailbox, uid, modseq from mailbox_messages" );
+    d->t->enqueue( "create index mcl_mm "
+                   "on mailbox_change_log(mailbox,modseq)" );
+    d->t->enqueue( "create function log_mailbox_change() "
+                   "returns trigger as $$"
+                   "begin "
+                   "insert into mailbox_change_log (mailbox, uid, modseq) "
+                   "values (new.mailbox, new.uid, new.modseq); "
+                   "return NULL; "
+                   "end;$$ language 'plpgsql' security definer" );
+    d->t->enqueue( "create trigger mailbox_messages_change_trigger "
+                   "after insert or update of mailbox, uid, modseq "
+                   "on mailbox_messages "
+                   "for each row "
+                   "execute procedure log_mailbox_change()" );
+    d->t->enqueue( "grant select, insert, delete on mailbox_change_log "
+                   "to " + d->dbuser );
+    return true;
+}
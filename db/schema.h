@@ -123,6 +123,14 @@ private:
     bool stepTo96();
     bool stepTo97();
     bool stepTo98();
+    bool stepTo99();
+    bool stepTo100();
+    bool stepTo101();
+    bool stepTo102();
+    bool stepTo103();
+    bool stepTo104();
+    bool stepTo105();
+    bool stepTo106();
 
     void describeStep( const EString & );
 };
@@ -24,6 +24,8 @@
 #include "euckr.h"
 #include "gbk.h"
 
+#include <string.h> // memcpy
+
 
 /*! \class Codec codec.h
     The Codec class describes a mapping between UString and anything else.
@@ -507,6 +509,18 @@ Codec * Codec::byString( const EString & s )
 */
 
 
+TableCodec::TableCodec( const uint * table, const char * cs )
+    : Codec( cs ), t( table ), ascii( true )
+{
+    uint c = 1;
+    while ( ascii && c < 128 ) {
+        if ( t[c] != c )
+            ascii = false;
+        c++;
+    }
+}
+
+
 /*! Converts \a u from Unicode to the subclass' character encoding. All
     Unicode code points which cannot be representated in that encoding
     are converted to '?'.
@@ -518,8 +532,14 @@ EString TableCodec::fromUnicode( const UString & u )
     s.reserve( u.length() );
     uint i = 0;
     while ( i < u.length() ) {
+        uint c = u[i];
+        if ( ascii && c > 0 && c < 128 ) {
+            s.append( (char)c );
+            i++;
+            continue;
+        }
         uint j = 0;
-        while ( j < 256 && t[j] != u[i] )
+        while ( j < 256 && t[j] != c )
             j++;
         if ( j < 256 )
             s.append( (char)j );
@@ -540,6 +560,15 @@ UString TableCodec::toUnicode( const EString & s )
     u.reserve( s.length() );
     uint i = 0;
     while ( i < s.length() ) {
+        uint n = 0;
+        if ( ascii )
+            n = asciiRun( s, i );
+        if ( n ) {
+            mangleTrailingSurrogate( u );
+            u.append( s.data() + i, n );
+            i += n;
+            continue;
+        }
         uint c = s[i];
         if ( !t[c] ) {
             recordError( i, c );
@@ -618,6 +647,34 @@ void Codec::append( UString & u, uint c )
 }
 
 
+/*! Returns the number of bytes in \a s, starting at \a i, before the
+    first byte that is either 0 or above 127. Most mail text consists
+    of long runs of such bytes, which codecs can copy without looking
+    at each character. The scan looks at eight bytes at a time.
+*/
+
+uint Codec::asciiRun( const EString & s, uint i )
+{
+    if ( i >= s.length() )
+        return 0;
+    const char * p = s.data() + i;
+    uint n = s.length() - i;
+    uint j = 0;
+    const unsigned long long ones = 0x0101010101010101ULL;
+    const unsigned long long highs = 0x8080808080808080ULL;
+    while ( j + 8 <= n ) {
+        unsigned long long w;
+        memcpy( &w, p + j, 8 );
+        if ( ( w & highs ) || ( ( w - ones ) & ~w & highs ) )
+            break;
+        j += 8;
+    }
+    while ( j < n && (unsigned char)p[j] > 0 && (unsigned char)p[j] < 128 )
+        j++;
+    return j;
+}
+
+
 /*! Checks whether the last codepoint in \a u is a leading surrogate,
     and flags an error if so.
 */
@@ -42,6 +42,8 @@ public:
     void append( UString &, uint );
     void mangleTrailingSurrogate( UString & );
 
+    static uint asciiRun( const EString &, uint );
+
     static class EStringList * allCodecNames();
 
 private:
@@ -54,8 +56,7 @@ private:
 
 class TableCodec: public Codec {
 protected:
-    TableCodec( const uint * table, const char * cs )
-        : Codec( cs ), t( table ) {}
+    TableCodec( const uint *, const char * );
 
 public:
     EString fromUnicode( const UString & );
@@ -63,6 +64,7 @@ public:
 
 private:
     const uint * t;
+    bool ascii;
 };
 
 
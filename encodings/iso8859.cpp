@@ -30,14 +30,21 @@ EString Iso88591Codec::fromUnicode( const UString & u )
 {
     EString s;
     s.reserve( u.length() );
+    char buf[128];
+    uint n = 0;
     uint i = 0;
     while ( i < u.length() ) {
         if ( u[i] < 256 )
-            s.append( (char)u[i] );
+            buf[n++] = (char)u[i];
         else
-            s.append( '?' );
+            buf[n++] = '?';
+        if ( n == sizeof( buf ) ) {
+            s.append( buf, n );
+            n = 0;
+        }
         i++;
     }
+    s.append( buf, n );
     return s;
 }
 
@@ -46,15 +53,14 @@ EString Iso88591Codec::fromUnicode( const UString & u )
 
 UString Iso88591Codec::toUnicode( const EString & s )
 {
-    UString u;
-    u.reserve( s.length() );
     uint i = 0;
-    while ( i < s.length() ) {
-        u.append( s[i] );
-        if ( s[i] >= 0x80 && s[i] < 0xA0 )
-            setState( BadlyFormed );
+    while ( i < s.length() && ( s[i] < 0x80 || s[i] >= 0xA0 ) )
         i++;
-    }
+    if ( i < s.length() )
+        setState( BadlyFormed );
+
+    UString u;
+    u.append( s.data(), s.length() );
     return u;
 }
 
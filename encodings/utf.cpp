@@ -42,6 +42,17 @@ EString Utf8Codec::fromUnicode( const UString & u )
     r.reserve( u.length() + 40 );
     uint i = 0;
     while ( i < u.length() ) {
+        // copy runs of ASCII a chunk at a time
+        char buf[128];
+        uint n = 0;
+        while ( n < sizeof( buf ) && i < u.length() &&
+                u[i] < 0x80 && ( u[i] || !pgutf ) )
+            buf[n++] = (char)u[i++];
+        if ( n ) {
+            r.append( buf, n );
+            continue;
+        }
+
         int c = u[i];
         if ( pgutf && !c ) {
             // append U+ED00 since postgres cannot store 0 bytes
@@ -120,6 +131,14 @@ UString Utf8Codec::toUnicode( const EString & s )
     u.reserve( s.length() );
     uint i = 0;
     while ( i < s.length() ) {
+        uint n = asciiRun( s, i );
+        if ( n ) {
+            mangleTrailingSurrogate( u );
+            u.append( s.data() + i, n );
+            i += n;
+            continue;
+        }
+
         int c = 0;
         if ( s[i] < 0x80 ) {
             // 0000 0000-0000 007F   0xxxxxxx
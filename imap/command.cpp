@@ -4,6 +4,7 @@
 
 #include "log.h"
 #include "utf.h"
+#include "span.h"
 #include "imap.h"
 #include "user.h"
 #include "buffer.h"
@@ -13,6 +14,7 @@
 #include "transaction.h"
 #include "imapsession.h"
 #include "mailboxgroup.h"
+#include "graph.h"
 
 // Keep these alphabetical.
 #include "handlers/acl.h"
@@ -53,6 +55,7 @@
 #include "handlers/urlfetch.h"
 
 #include <sys/time.h> // gettimeofday, struct timeval
+#include <string.h> // strlen
 
 
 class MailboxGroup;
@@ -75,7 +78,7 @@ public:
           imap( 0 ), session( 0 ), checker( 0 ),
           mailbox( 0 ), mailboxGroup( 0 ),
           checkedMailboxGroup( false ),
-          transaction( 0 )
+          transaction( 0 ), span( 0 )
     {
         (void)::gettimeofday( &started, 0 );
     }
@@ -112,6 +115,8 @@ public:
     bool checkedMailboxGroup;
 
     Transaction * transaction;
+
+    Span * span;
 };
 
 
@@ -169,6 +174,145 @@ Command::~Command()
 }
 
 
+// The commands create() knows, and the IMAP states in which each may
+// be used. UID FETCH etc. are found by looking up FETCH etc.
+
+enum Handler {
+    LoginHandler, AuthenticateHandler, StartTlsHandler,
+    SelectHandler, ExamineHandler, CreateHandler, DeleteHandler,
+    ListHandler, LsubHandler, NamespaceHandler, StatusHandler,
+    RenameHandler, SubscribeHandler, UnsubscribeHandler, AppendHandler,
+    SetAclHandler, DeleteAclHandler, GetAclHandler, ListRightsHandler,
+    MyRightsHandler, ResetKeyHandler, GenUrlauthHandler, UrlFetchHandler,
+    NotifyHandler, CompressHandler, GetQuotaHandler, SetQuotaHandler,
+    GetQuotaRootHandler, SetQuotaRootHandler,
+    FetchHandler, SearchHandler, ExpungeHandler, CheckHandler,
+    CloseHandler, StoreHandler, CopyHandler, ThreadHandler,
+    UnselectHandler, SortHandler, MoveHandler,
+    NoopHandler, CapabilityHandler, LogoutHandler, IdleHandler,
+    IdHandler, EnableHandler
+};
+
+
+static const uint NotAuthenticated = 1 << IMAP::NotAuthenticated;
+static const uint Authenticated = ( 1 << IMAP::Authenticated ) |
+                                  ( 1 << IMAP::Selected );
+static const uint Selected = 1 << IMAP::Selected;
+static const uint AnyState = ( 1 << IMAP::NotAuthenticated ) |
+                             ( 1 << IMAP::Authenticated ) |
+                             ( 1 << IMAP::Selected ) |
+                             ( 1 << IMAP::Logout );
+
+
+static const struct CommandName {
+    const char * name;
+    Handler handler;
+    uint states;
+} commandNames[] = {
+    { "login", LoginHandler, NotAuthenticated },
+    { "authenticate", AuthenticateHandler, NotAuthenticated },
+    { "starttls", StartTlsHandler, NotAuthenticated },
+    { "select", SelectHandler, Authenticated },
+    { "examine", ExamineHandler, Authenticated },
+    { "create", CreateHandler, Authenticated },
+    { "delete", DeleteHandler, Authenticated },
+    { "list", ListHandler, Authenticated },
+    { "lsub", LsubHandler, Authenticated },
+    { "namespace", NamespaceHandler, Authenticated },
+    { "status", StatusHandler, Authenticated },
+    { "rename", RenameHandler, Authenticated },
+    { "subscribe", SubscribeHandler, Authenticated },
+    { "unsubscribe", UnsubscribeHandler, Authenticated },
+    { "append", AppendHandler, Authenticated },
+    { "setacl", SetAclHandler, Authenticated },
+    { "deleteacl", DeleteAclHandler, Authenticated },
+    { "getacl", GetAclHandler, Authenticated },
+    { "listrights", ListRightsHandler, Authenticated },
+    { "myrights", MyRightsHandler, Authenticated },
+    { "resetkey", ResetKeyHandler, Authenticated },
+    { "genurlauth", GenUrlauthHandler, Authenticated },
+    { "urlfetch", UrlFetchHandler, Authenticated },
+    { "notify", NotifyHandler, Authenticated },
+    { "compress", CompressHandler, Authenticated },
+    { "getquota", GetQuotaHandler, Authenticated },
+    { "setquota", SetQuotaHandler, Authenticated },
+    { "getquotaroot", GetQuotaRootHandler, Authenticated },
+    { "setquotaroot", SetQuotaRootHandler, Authenticated },
+    { "fetch", FetchHandler, Selected },
+    { "search", SearchHandler, Selected },
+    { "expunge", ExpungeHandler, Selected },
+    { "check", CheckHandler, Selected },
+    { "close", CloseHandler, Selected },
+    { "store", StoreHandler, Selected },
+    { "copy", CopyHandler, Selected },
+    { "thread", ThreadHandler, Selected },
+    { "unselect", UnselectHandler, Selected },
+    { "sort", SortHandler, Selected },
+    { "move", MoveHandler, Selected },
+    { "noop", NoopHandler, AnyState },
+    { "capability", CapabilityHandler, AnyState },
+    { "logout", LogoutHandler, AnyState },
+    { "idle", IdleHandler, AnyState },
+    { "id", IdHandler, AnyState },
+    { "enable", EnableHandler, AnyState },
+    { 0, NoopHandler, 0 }
+};
+
+
+// An open-addressed hash table over commandNames, built on first
+// use. It has room for more than twice as many commands as exist, so
+// almost every lookup hits on the first probe.
+
+static const uint HashSize = 128;
+static const CommandName * commandHash[HashSize];
+static bool commandHashBuilt = false;
+
+
+static uint hashedName( const char * s, uint l )
+{
+    uint h = 2166136261u;
+    uint i = 0;
+    while ( i < l ) {
+        char c = s[i];
+        if ( c >= 'A' && c <= 'Z' )
+            c = c + 32;
+        h = ( h ^ (unsigned char)c ) * 16777619u;
+        i++;
+    }
+    return h;
+}
+
+
+static const CommandName * commandName( const char * s, uint l )
+{
+    if ( !commandHashBuilt ) {
+        uint i = 0;
+        while ( commandNames[i].name ) {
+            const char * n = commandNames[i].name;
+            uint h = hashedName( n, strlen( n ) ) % HashSize;
+            while ( commandHash[h] )
+                h = ( h + 1 ) % HashSize;
+            commandHash[h] = &commandNames[i];
+            i++;
+        }
+        commandHashBuilt = true;
+    }
+
+    uint h = hashedName( s, l ) % HashSize;
+    while ( commandHash[h] ) {
+        const char * n = commandHash[h]->name;
+        uint i = 0;
+        while ( i < l && n[i] &&
+                ( s[i] == n[i] || s[i] + 32 == n[i] ) )
+            i++;
+        if ( i == l && !n[i] )
+            return commandHash[h];
+        h = ( h + 1 ) % HashSize;
+    }
+    return 0;
+}
+
+
 /*! This static function creates an instance of the right subclass of
     Command, depending on \a name and the state of \a imap.
 
@@ -185,159 +329,178 @@ Command * Command::create( IMAP * imap,
                            const EString & name,
                            ImapParser * args )
 {
-    Command * c = 0;
-    EString n = name.lower();
+    const char * n = name.data();
+    uint l = name.length();
     bool uid = false;
-    if ( n.startsWith( "uid " ) ) {
+    if ( l > 4 && ( n[0] == 'u' || n[0] == 'U' ) &&
+         ( n[1] == 'i' || n[1] == 'I' ) &&
+         ( n[2] == 'd' || n[2] == 'D' ) && n[3] == ' ' ) {
         uid = true;
-        n = n.mid( 4 );
+        n += 4;
+        l -= 4;
     }
 
-    bool notAuthenticated = false;
-    bool authenticated = false;
-    bool selected = false;
-    bool logout = false;
+    const CommandName * cn = 0;
+    if ( l )
+        cn = commandName( n, l );
+    if ( !cn )
+        return 0;
 
     // Create an appropriate Command handler.
-    if ( n == "login" )
+    Command * c = 0;
+    switch ( cn->handler ) {
+    case LoginHandler:
         c = new Login;
-    else if ( n == "authenticate" )
+        break;
+    case AuthenticateHandler:
         c = new Authenticate;
-    else if ( n == "starttls" )
+        break;
+    case StartTlsHandler:
         c = new StartTLS;
-
-    if ( c )
-        notAuthenticated = true;
-
-    if ( !c ) {
-        if ( n == "select" )
-            c = new Select;
-        else if ( n == "examine" )
-            c = new Examine;
-        else if ( n == "create" )
-            c = new Create;
-        else if ( n == "delete" )
-            c = new Delete;
-        else if ( n == "list" )
-            c = new Listext;
-        else if ( n == "lsub" )
-            c = new Lsub;
-        else if ( n == "namespace" )
-            c = new Namespace;
-        else if ( n == "status" )
-            c = new Status;
-        else if ( n == "rename" )
-            c = new Rename;
-        else if ( n == "subscribe" )
-            c = new Subscribe;
-        else if ( n == "unsubscribe" )
-            c = new Unsubscribe;
-        else if ( n == "append" )
-            c = new Append;
-        else if ( n == "setacl" )
-            c = new Acl( Acl::SetAcl );
-        else if ( n == "deleteacl" )
-            c = new Acl( Acl::DeleteAcl );
-        else if ( n == "getacl" )
-            c = new Acl( Acl::GetAcl );
-        else if ( n == "listrights" )
-            c = new Acl( Acl::ListRights );
-        else if ( n == "myrights" )
-            c = new Acl( Acl::MyRights );
-        else if ( n == "resetkey" )
-            c = new ResetKey;
-        else if ( n == "genurlauth" )
-            c = new GenUrlauth;
-        else if ( n == "urlfetch" )
-            c = new UrlFetch;
-        else if ( n == "notify" )
-            c = new Notify;
-        else if ( n == "compress" )
-            c = new Compress;
-        else if ( n == "getquota" )
-            c = new GetQuota();
-        else if ( n == "setquota" )
-            c = new SetQuota();
-        else if ( n == "getquotaroot" )
-            c = new GetQuotaRoot();
-        else if ( n == "setquotaroot" )
-            c = new SetQuotaRoot();
-
-        if ( c ) {
-            authenticated = true;
-            selected = true;
-        }
-    }
-
-    if ( !c ) {
-        if ( n == "fetch" )
-            c = new Fetch( uid );
-        else if ( n == "search" )
-            c = new Search( uid );
-        else if ( n == "expunge" )
-            c = new Expunge( uid );
-        else if ( n == "check" )
-            c = new Check;
-        else if ( n == "close" )
-            c = new Close;
-        else if ( n == "store" )
-            c = new Store( uid );
-        else if ( n == "copy" )
-            c = new Copy( uid );
-        else if ( n == "thread" )
-            c = new Thread( uid );
-        else if ( n == "unselect" )
-            c = new Unselect;
-        else if ( n == "sort" )
-            c = new Sort( uid );
-        else if ( n == "move" )
-            c = new Move( uid );
-
-        if ( c )
-            selected = true;
-    }
-
-    if ( !c ) {
-        if ( n == "noop" )
-            c = new Noop;
-        else if ( n == "capability" )
-            c = new Capability;
-        else if ( n == "logout" )
-            c = new Logout;
-        else if ( n == "idle" )
-            c = new Idle;
-        else if ( n == "id" )
-            c = new Id;
-        else if ( n == "enable" )
-            c = new Enable;
-
-        if ( c ) {
-            notAuthenticated = true;
-            authenticated = true;
-            selected = true;
-            logout = true;
-        }
+        break;
+    case SelectHandler:
+        c = new Select;
+        break;
+    case ExamineHandler:
+        c = new Examine;
+        break;
+    case CreateHandler:
+        c = new Create;
+        break;
+    case DeleteHandler:
+        c = new Delete;
+        break;
+    case ListHandler:
+        c = new Listext;
+        break;
+    case LsubHandler:
+        c = new Lsub;
+        break;
+    case NamespaceHandler:
+        c = new Namespace;
+        break;
+    case StatusHandler:
+        c = new Status;
+        break;
+    case RenameHandler:
+        c = new Rename;
+        break;
+    case SubscribeHandler:
+        c = new Subscribe;
+        break;
+    case UnsubscribeHandler:
+        c = new Unsubscribe;
+        break;
+    case AppendHandler:
+        c = new Append;
+        break;
+    case SetAclHandler:
+        c = new Acl( Acl::SetAcl );
+        break;
+    case DeleteAclHandler:
+        c = new Acl( Acl::DeleteAcl );
+        break;
+    case GetAclHandler:
+        c = new Acl( Acl::GetAcl );
+        break;
+    case ListRightsHandler:
+        c = new Acl( Acl::ListRights );
+        break;
+    case MyRightsHandler:
+        c = new Acl( Acl::MyRights );
+        break;
+    case ResetKeyHandler:
+        c = new ResetKey;
+        break;
+    case GenUrlauthHandler:
+        c = new GenUrlauth;
+        break;
+    case UrlFetchHandler:
+        c = new UrlFetch;
+        break;
+    case NotifyHandler:
+        c = new Notify;
+        break;
+    case CompressHandler:
+        c = new Compress;
+        break;
+    case GetQuotaHandler:
+        c = new GetQuota();
+        break;
+    case SetQuotaHandler:
+        c = new SetQuota();
+        break;
+    case GetQuotaRootHandler:
+        c = new GetQuotaRoot();
+        break;
+    case SetQuotaRootHandler:
+        c = new SetQuotaRoot();
+        break;
+    case FetchHandler:
+        c = new Fetch( uid );
+        break;
+    case SearchHandler:
+        c = new Search( uid );
+        break;
+    case ExpungeHandler:
+        c = new Expunge( uid );
+        break;
+    case CheckHandler:
+        c = new Check;
+        break;
+    case CloseHandler:
+        c = new Close;
+        break;
+    case StoreHandler:
+        c = new Store( uid );
+        break;
+    case CopyHandler:
+        c = new Copy( uid );
+        break;
+    case ThreadHandler:
+        c = new Thread( uid );
+        break;
+    case UnselectHandler:
+        c = new Unselect;
+        break;
+    case SortHandler:
+        c = new Sort( uid );
+        break;
+    case MoveHandler:
+        c = new Move( uid );
+        break;
+    case NoopHandler:
+        c = new Noop;
+        break;
+    case CapabilityHandler:
+        c = new Capability;
+        break;
+    case LogoutHandler:
+        c = new Logout;
+        break;
+    case IdleHandler:
+        c = new Idle;
+        break;
+    case IdHandler:
+        c = new Id;
+        break;
+    case EnableHandler:
+        c = new Enable;
+        break;
     }
 
-    if ( !c )
-        return 0;
-
     c->d->tag = tag;
     c->d->name = name.lower();
     c->setParser( args );
     c->d->imap = imap;
-
-    if ( notAuthenticated )
-        c->d->permittedStates |= ( 1 << IMAP::NotAuthenticated );
-    if ( authenticated )
-        c->d->permittedStates |= ( 1 << IMAP::Authenticated );
-    if ( selected )
-        c->d->permittedStates |= ( 1 << IMAP::Selected );
-    if ( logout )
-        c->d->permittedStates |= ( 1 << IMAP::Logout );
+    c->d->permittedStates = cn->states;
 
     c->setLog( new Log );
     c->log( "IMAP Command: " + tag + " " + name );
+    if ( c->d->name != "idle" ) {
+        c->d->span = new Span( c->log(), "IMAP " + tag + " " + name );
+        c->d->span->enter( "parse" );
+    }
 
     return c;
 }
@@ -454,15 +617,21 @@ void Command::setState( State s )
     switch( s ) {
     case Retired:
         log( "Retired", Log::Debug );
+        if ( d->span )
+            d->span->finish();
         break;
     case Unparsed:
         // this is the initial state, it should never be called.
         break;
     case Blocked:
         log( "Deferring execution", Log::Debug );
+        if ( d->span )
+            d->span->enter( "queue" );
         break;
     case Executing:
         (void)::gettimeofday( &d->started, 0 );
+        if ( d->span )
+            d->span->enter( "execute" );
         if ( d->permittedStates & ( 1 << imap()->state() ) ) {
             log( "Executing", Log::Debug );
             d->session = (ImapSession*)(imap()->session());
@@ -480,6 +649,9 @@ void Command::setState( State s )
             long elapsed =
                 ( end.tv_sec - d->started.tv_sec ) * 1000000 +
                 ( end.tv_usec - d->started.tv_usec );
+            GraphableHistogram::find( "imap-command-milliseconds",
+                                      "command=\"" + d->name + "\"" )
+                ->addValue( ( elapsed + 499 ) / 1000 );
             Log::Severity level = Log::Debug;
             if ( elapsed > 3000 )
                 level = Log::Info;
@@ -490,6 +662,8 @@ void Command::setState( State s )
             log( m, level );
         }
         log( "Finished", Log::Debug );
+        if ( d->span )
+            d->span->enter( "emit" );
         break;
     }
     imap()->unblockCommands();
@@ -1372,8 +1546,13 @@ bool Command::permitted()
 {
     if ( !d->checker )
         return false;
-    if ( !d->checker->ready() )
+    if ( !d->checker->ready() ) {
+        if ( d->span )
+            d->span->enter( "permission" );
         return false;
+    }
+    if ( d->span )
+        d->span->enter( "execute" );
     if ( d->checker->allowed() )
         return true;
     error( No, d->checker->error().simplified() );
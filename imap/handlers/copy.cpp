@@ -17,15 +17,17 @@ public:
     CopyData() :
         uid( false ), move( false ),
         mailbox( 0 ),
-        findUid( 0 ),
-        report( 0 )
+        findMessages( 0 ), findUid( 0 ),
+        copying( false )
     {}
     bool uid;
     bool move;
     IntegerSet set;
     Mailbox * mailbox;
+    Query * findMessages;
     Query * findUid;
-    Query * report;
+    bool copying;
+    IntegerSet from;
     uint toUid;
     int64 toMs;
     int64 fromMs;
@@ -104,6 +106,18 @@ void Copy::execute()
     if ( !transaction() ) {
         setTransaction( new Transaction( this ) );
 
+        // find and lock the messages before the mailboxes, as Store
+        // does. the lock keeps the list valid until we commit.
+        EString lock( "share" );
+        if ( d->move )
+            lock = "update";
+        d->findMessages = new Query( "select uid from mailbox_messages "
+                                     "where mailbox=$1 and uid=any($2) "
+                                     "order by uid for " + lock, this );
+        d->findMessages->bind( 1, session()->mailbox()->id() );
+        d->findMessages->bind( 2, d->set );
+        transaction()->enqueue( d->findMessages );
+
         d->findUid = new Query( "select id,uidnext,nextmodseq from mailboxes "
                                 "where id=$1 or id=$2 order by id for update",
                                 this );
@@ -129,97 +143,126 @@ void Copy::execute()
         }
     }
 
-    if ( !d->findUid->done() )
+    while ( d->findMessages->hasResults() )
+        d->from.add( d->findMessages->nextRow()->getInt( "uid" ) );
+
+    if ( !d->findUid->done() || !d->findMessages->done() )
         return;
 
-    if ( !d->report ) {
+    if ( !d->copying ) {
         if ( !d->toMs )
             error( No, "Could not allocate UID and modseq in target mailbox" );
 
+        d->copying = true;
+        uint n = d->from.count();
+        uint source = session()->mailbox()->id();
+
+        // message i in from (counting from 1) becomes toUid+i-1 in
+        // the target mailbox. everything below uses the same array,
+        // so there's no need for a work table.
+        EString t( "from generate_subscripts($2::int[],1) i "
+                   "join " );
+        EString nuid( "$3+i-1" );
         Query * q;
 
-        q = new Query( "create temporary table t ("
-                       "mailbox integer,"
-                       "uid integer,"
-                       "message integer,"
-                       "nuid integer,"
-                       "seen boolean"
-                       ")", 0 );
-        transaction()->enqueue( q );
+        // moving to another mailbox renumbers the rows in place, and
+        // the flags and annotations follow by "on update cascade".
+        bool inPlace = d->move && d->mailbox != session()->mailbox();
+
+        if ( inPlace ) {
+            q = new Query( "update mailbox_messages "
+                           "set mailbox=$1, uid=w.nuid, modseq=$5, "
+                           "deleted=false "
+                           "from (select ($2::int[])[i] as uid, " +
+                           nuid + " as nuid "
+                           "from generate_subscripts($2::int[],1) i) w "
+                           "where mailbox_messages.mailbox=$4 "
+                           "and mailbox_messages.uid=w.uid", 0 );
+            q->bind( 1, d->mailbox->id() );
+            q->bind( 2, d->from );
+            q->bind( 3, d->toUid );
+            q->bind( 4, source );
+            q->bind( 5, d->toMs );
+            transaction()->enqueue( q );
+        }
+        else {
+            q = new Query( "insert into mailbox_messages "
+                           "(mailbox, uid, message, modseq, seen, deleted) "
+                           "select $1, " + nuid + ", mm.message, $5, "
+                           "mm.seen, false " + t + "mailbox_messages mm on "
+                           "(mm.mailbox=$4 and mm.uid=($2::int[])[i])", 0 );
+            q->bind( 1, d->mailbox->id() );
+            q->bind( 2, d->from );
+            q->bind( 3, d->toUid );
+            q->bind( 4, source );
+            q->bind( 5, d->toMs );
+            transaction()->enqueue( q );
 
-        q = new Query( "create temporary sequence s start " + fn( d->toUid ),
-                       0 );
-        transaction()->enqueue( q );
+            q = new Query( "insert into flags "
+                           "(mailbox, uid, flag) "
+                           "select $1, " + nuid + ", f.flag " +
+                           t + "flags f on "
+                           "(f.mailbox=$4 and f.uid=($2::int[])[i])", 0 );
+            q->bind( 1, d->mailbox->id() );
+            q->bind( 2, d->from );
+            q->bind( 3, d->toUid );
+            q->bind( 4, source );
+            transaction()->enqueue( q );
 
-        q = new Query( "insert into t "
-                       "(mailbox, uid, message, nuid, seen) "
-                       "select mailbox, uid, message, nextval('s'), seen "
-                       "from mailbox_messages "
-                       "where mailbox=$1 and uid=any($2) order by uid", 0 );
-        q->bind( 1, session()->mailbox()->id() );
-        q->bind( 2, d->set );
-        transaction()->enqueue( q );
+            q = new Query( "insert into annotations "
+                           "(mailbox, uid, owner, name, value) "
+                           "select $1, " + nuid + ", "
+                           "a.owner, a.name, a.value " +
+                           t + "annotations a on "
+                           "(a.mailbox=$4 and a.uid=($2::int[])[i]) "
+                           "where a.owner is null or a.owner=$5", 0 );
+            q->bind( 1, d->mailbox->id() );
+            q->bind( 2, d->from );
+            q->bind( 3, d->toUid );
+            q->bind( 4, source );
+            q->bind( 5, imap()->user()->id() );
+            transaction()->enqueue( q );
+        }
 
         q = new Query( "update mailboxes "
-                       "set uidnext=nextval('s'), nextmodseq=$1 "
-                       "where id=$2",
-                       this );
-        q->bind( 1, d->toMs+1 );
-        q->bind( 2, d->mailbox->id() );
+                       "set uidnext=$1, nextmodseq=$2 "
+                       "where id=$3", 0 );
+        q->bind( 1, d->toUid + n );
+        q->bind( 2, d->toMs+1 );
+        q->bind( 3, d->mailbox->id() );
         transaction()->enqueue( q );
 
-        transaction()->enqueue( new Query( "drop sequence s", 0 ) );
-
-        q = new Query( "insert into mailbox_messages "
-                       "(mailbox, uid, message, modseq, seen, deleted) "
-                       "select $1, t.nuid, message, $2, t.seen, false "
-                       "from t", 0 );
-        q->bind( 1, d->mailbox->id() );
-        q->bind( 2, d->toMs );
-        transaction()->enqueue( q );
-
-        q = new Query( "insert into flags "
-                       "(mailbox, uid, flag) "
-                       "select $1, t.nuid, f.flag "
-                       "from flags f join t using (mailbox, uid)", 0 );
-        q->bind( 1, d->mailbox->id() );
-        transaction()->enqueue( q );
-
-        q = new Query( "insert into annotations "
-                       "(mailbox, uid, owner, name, value) "
-                       "select $1, t.nuid, a.owner, a.name, a.value "
-                       "from annotations a join t using (mailbox, uid) "
-                       "where a.owner is null or a.owner=$2", 0 );
-        q->bind( 1, d->mailbox->id() );
-        q->bind( 2, imap()->user()->id() );
-        transaction()->enqueue( q );
-
-        d->report = new Query( "select uid, nuid from t", 0 );
-        transaction()->enqueue( d->report );
-
         if ( d->move ) {
+            // record what the source mailbox lost. after an in-place
+            // move, the rows are found at their new UIDs, and the
+            // trigger on deleted_messages finds nothing to delete.
+            EString mm( "(mm.mailbox=$4 and mm.uid=($2::int[])[i])" );
+            if ( inPlace )
+                mm = "(mm.mailbox=$7 and mm.uid=" + nuid + ")";
             q = new Query(
                 "insert into deleted_messages "
                 "(mailbox,uid,message,modseq,deleted_by,reason) "
-                "select $1, t.uid, t.message, $2, $3, "
-                " 'moved to mailbox '||$4||' uid '||t.nuid "
-                "from t", 0 );
-            q->bind( 1, session()->mailbox()->id() );
-            q->bind( 2, d->fromMs );
-            q->bind( 3, imap()->user()->id() );
-            q->bind( 4, d->mailbox->name() );
+                "select $4, ($2::int[])[i], mm.message, $5, $6, "
+                " 'moved to mailbox '||$1||' uid '||(" + nuid + ") " +
+                t + "mailbox_messages mm on " + mm, 0 );
+            q->bind( 1, d->mailbox->name() );
+            q->bind( 2, d->from );
+            q->bind( 3, d->toUid );
+            q->bind( 4, source );
+            q->bind( 5, d->fromMs );
+            q->bind( 6, imap()->user()->id() );
+            if ( inPlace )
+                q->bind( 7, d->mailbox->id() );
             transaction()->enqueue( q );
             q = new Query( "update mailboxes "
                            "set nextmodseq=$1 "
                            "where id=$2",
                            0 );
             q->bind( 1, d->fromMs+1 );
-            q->bind( 2, session()->mailbox()->id() );
+            q->bind( 2, source );
             transaction()->enqueue( q );
         }
 
-        transaction()->enqueue( new Query( "drop table t", 0 ) );
-
         Mailbox::refreshMailboxes( transaction() );
 
         transaction()->commit();
@@ -238,18 +281,12 @@ void Copy::execute()
          !imap()->session()->initialised() )
         return;
 
-    IntegerSet from;
-    IntegerSet to;
-
-    while ( d->report->hasResults() ) {
-        Row * r = d->report->nextRow();
-        from.add( r->getInt( "uid" ) );
-        to.add( r->getInt( "nuid" ) );
-    }
-
-    if ( !from.isEmpty() )
+    if ( !d->from.isEmpty() ) {
+        IntegerSet to;
+        to.add( d->toUid, d->toUid + d->from.count() - 1 );
         setRespTextCode( "COPYUID " +
                          fn( d->mailbox->uidvalidity() ) + " " +
-                         from.set() + " " + to.set() );
+                         d->from.set() + " " + to.set() );
+    }
     finish();
 }
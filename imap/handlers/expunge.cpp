@@ -112,11 +112,7 @@ void Expunge::execute()
     if ( !transaction() ) {
         setTransaction( new Transaction( this ) );
 
-        d->findModseq = new Query( "select nextmodseq from mailboxes "
-                                   "where id=$1 for update", this );
-        d->findModseq->bind( 1, d->s->mailbox()->id() );
-        transaction()->enqueue( d->findModseq );
-
+        // lock the messages before the mailbox, as Store does.
         d->findUids = new Query( "", this );
         d->findUids->bind( 1, d->s->mailbox()->id() );
         EString query( "select uid from mailbox_messages "
@@ -129,6 +125,11 @@ void Expunge::execute()
         d->findUids->setString( query );
         transaction()->enqueue( d->findUids );
 
+        d->findModseq = new Query( "select nextmodseq from mailboxes "
+                                   "where id=$1 for update", this );
+        d->findModseq->bind( 1, d->s->mailbox()->id() );
+        transaction()->enqueue( d->findModseq );
+
         transaction()->execute();
     }
 
@@ -142,7 +143,7 @@ void Expunge::execute()
         d->modseq = r->getBigint( "nextmodseq" );
     }
 
-    if ( !d->findUids->done() )
+    if ( !d->findUids->done() || !d->findModseq->done() )
         return;
 
     if ( !d->r->done() )
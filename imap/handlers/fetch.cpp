@@ -20,6 +20,7 @@
 #include "fetcher.h"
 #include "iso8859.h"
 #include "codec.h"
+#include "cache.h"
 #include "query.h"
 #include "scope.h"
 #include "store.h"
@@ -60,8 +61,12 @@ public:
           databaseId( false ), threadId( false ), vanished( false ),
           needsHeader( false ), needsAddresses( false ),
           needsBody( false ), needsPartNumbers( false ),
+          needsStructure( false ), useStructures( false ),
+          structuresKnown( false ),
           seenDeletedFetcher( 0 ), flagFetcher( 0 ),
-          annotationFetcher( 0 ), modseqFetcher( 0 )
+          annotationFetcher( 0 ), modseqFetcher( 0 ),
+          structureFetcher( 0 ), fetcher( 0 ),
+          shared( false ), nextModSeq( 0 ), changes( 0 )
     {}
 
     int state;
@@ -98,6 +103,24 @@ public:
     bool needsBody;
     bool needsPartNumbers;
 
+    // envelope, body and bodystructure need header, addresses and
+    // part numbers, unless we can use message_structures
+    bool needsStructure;
+    bool useStructures;
+    bool structuresKnown;
+
+    struct Structure
+        : public Garbage
+    {
+    public:
+        Structure() {}
+        EString envelope;
+        EString body;
+        EString bodystructure;
+    };
+    Map<Structure> structures;
+    IntegerSet unstructured;
+
     EStringList entries;
     EStringList attribs;
 
@@ -115,8 +138,242 @@ public:
     Query * flagFetcher;
     Query * annotationFetcher;
     Query * modseqFetcher;
+    Query * structureFetcher;
+    Fetcher * fetcher;
+
+    // flag updates may share the work with other sessions
+    bool shared;
+    int64 nextModSeq;
+    class FetchChanges * changes;
+};
+
+
+class FetchChanges
+    : public EventHandler
+{
+public:
+    FetchChanges( Mailbox *, int64, int64, bool );
+
+    void execute();
+
+    static FetchChanges * find( Mailbox *, int64, int64, bool );
+
+    Mailbox * mailbox;
+    int64 changedSince;
+    int64 nextModSeq;
+    bool annotations;
+    bool done;
+    Transaction * t;
+    Query * rows;
+    Query * flags;
+    Query * annotationRows;
+    Map<Message> messages;
+    Map<FetchData::DynamicData> dynamics;
+    List<Fetch> waiting;
+};
+
+
+class FetchChangesCache
+    : public Cache
+{
+public:
+    FetchChangesCache(): Cache( 1 ) {}
+    void clear() { changes.clear(); }
+
+    List<FetchChanges> changes;
 };
 
+static FetchChangesCache * changesCache = 0;
+
+
+/* The FetchChanges class fetches the flags, modseqs and annotations
+    of every message in a mailbox that changed after a given modseq,
+    on behalf of all the implicit flag-update Fetch handlers in this
+    process that need them.
+
+    When a message is delivered or flagged, SessionInitialiser brings
+    all of a mailbox's sessions up to date at once, and each IMAP
+    session then announces the changes using its own Fetch. Without
+    this class, each such Fetch would send its own three or four
+    queries, so with hundreds of IDLE clients in a mailbox a single
+    change would cause hundreds of identical queries. With it, the
+    first Fetch creates a FetchChanges, the rest find() and wait for
+    it, and each picks out the UIDs its session wants.
+
+    The rows are keyed by the mailbox, the modseq after which changes
+    are wanted and the session's next modseq, so a FetchChanges is
+    only reused for the same round of updates, and by garbage
+    collection it's forgotten.
+*/
+
+
+/* Constructs a FetchChanges for the messages in \a mailbox whose
+    modseq is greater than \a changedSince, as seen by sessions whose
+    next modseq is \a nextModSeq, and starts the queries. Annotations
+    are fetched as well if \a annotations is true.
+*/
+
+FetchChanges::FetchChanges( Mailbox * mailbox, int64 changedSince,
+                            int64 nextModSeq, bool annotations )
+    : EventHandler(),
+      mailbox( mailbox ), changedSince( changedSince ),
+      nextModSeq( nextModSeq ), annotations( annotations ),
+      done( false ), t( 0 ), rows( 0 ), flags( 0 ), annotationRows( 0 )
+{
+    setLog( new Log );
+    Scope x( log() );
+    log( "Fetching changes in " + mailbox->name().ascii() +
+         " for modseq>" + fn( changedSince ) );
+
+    t = new Transaction( this );
+
+    // mailbox_change_log lists the candidates; the modseq test on
+    // mailbox_messages discards superseded changes.
+    EString changed( "(select uid from mailbox_change_log "
+                     "where mailbox=$1 and modseq>$2)" );
+
+    rows = new Query( "select uid, message, modseq, seen, deleted "
+                      "from mailbox_messages "
+                      "where mailbox=$1 and modseq>$2 "
+                      "and uid in " + changed, this );
+    rows->bind( 1, mailbox->id() );
+    rows->bind( 2, changedSince );
+    t->enqueue( rows );
+
+    flags = new Query( "select f.uid, fn.name from flags f "
+                       "join flag_names fn on (f.flag=fn.id) "
+                       "join mailbox_messages mm "
+                       " on (f.mailbox=mm.mailbox and f.uid=mm.uid) "
+                       "where mm.mailbox=$1 and mm.modseq>$2 "
+                       "and mm.uid in " + changed, this );
+    flags->bind( 1, mailbox->id() );
+    flags->bind( 2, changedSince );
+    t->enqueue( flags );
+
+    if ( annotations ) {
+        annotationRows = new Query( "select a.uid, "
+                                    "a.owner, a.value, an.name "
+                                    "from annotations a "
+                                    "join annotation_names an "
+                                    " on (a.name=an.id) "
+                                    "join mailbox_messages mm "
+                                    " on (a.mailbox=mm.mailbox and "
+                                    "a.uid=mm.uid) "
+                                    "where mm.mailbox=$1 and mm.modseq>$2 "
+                                    "and mm.uid in " + changed +
+                                    " order by an.name", this );
+        annotationRows->bind( 1, mailbox->id() );
+        annotationRows->bind( 2, changedSince );
+        t->enqueue( annotationRows );
+    }
+
+    t->commit();
+}
+
+
+/* Returns a FetchChanges for the messages in \a mailbox changed
+    after \a changedSince, for sessions whose next modseq is \a
+    nextModSeq, including annotations if \a annotations is
+    true. Reuses an existing one if possible, and creates one
+    otherwise.
+*/
+
+FetchChanges * FetchChanges::find( Mailbox * mailbox, int64 changedSince,
+                                   int64 nextModSeq, bool annotations )
+{
+    if ( !::changesCache )
+        ::changesCache = new FetchChangesCache;
+
+    List<FetchChanges>::Iterator i( ::changesCache->changes );
+    while ( i ) {
+        FetchChanges * c = i;
+        if ( c->mailbox != mailbox ) {
+            ++i;
+        }
+        else if ( c->nextModSeq != nextModSeq ) {
+            // from an earlier round of updates, so no longer useful
+            ::changesCache->changes.take( i );
+        }
+        else if ( c->changedSince == changedSince &&
+                  ( c->annotations || !annotations ) ) {
+            return c;
+        }
+        else {
+            ++i;
+        }
+    }
+
+    FetchChanges * c = new FetchChanges( mailbox, changedSince,
+                                         nextModSeq, annotations );
+    ::changesCache->changes.append( c );
+    return c;
+}
+
+
+void FetchChanges::execute()
+{
+    if ( done )
+        return;
+
+    if ( !t->done() )
+        return;
+
+    if ( t->failed() ) {
+        log( "Could not fetch changes: " + t->error(), Log::Error );
+        messages.clear();
+        dynamics.clear();
+        if ( ::changesCache )
+            ::changesCache->changes.remove( this );
+    }
+    else {
+        EString * seen = new EString( "\\Seen" );
+        EString * deleted = new EString( "\\Deleted" );
+        while ( rows->hasResults() ) {
+            Row * r = rows->nextRow();
+            uint uid = r->getInt( "uid" );
+            Message * m = MessageCache::provide( mailbox, uid );
+            m->setDatabaseId( r->getInt( "message" ) );
+            messages.insert( uid, m );
+            FetchData::DynamicData * dd = new FetchData::DynamicData;
+            dd->modseq = r->getBigint( "modseq" );
+            if ( r->getBoolean( "seen" ) )
+                dd->flags.insert( "\\seen", seen );
+            if ( r->getBoolean( "deleted" ) )
+                dd->flags.insert( "\\deleted", deleted );
+            dynamics.insert( uid, dd );
+        }
+
+        while ( flags->hasResults() ) {
+            Row * r = flags->nextRow();
+            FetchData::DynamicData * dd = dynamics.find( r->getInt( "uid" ) );
+            EString f = r->getEString( "name" );
+            if ( dd && !f.isEmpty() )
+                dd->flags.insert( f.lower(), new EString( f ) );
+        }
+
+        while ( annotationRows && annotationRows->hasResults() ) {
+            Row * r = annotationRows->nextRow();
+            FetchData::DynamicData * dd = dynamics.find( r->getInt( "uid" ) );
+            uint owner = 0;
+            if ( !r->isNull( "owner" ) )
+                owner = r->getInt( "owner" );
+            if ( dd )
+                dd->annotations.append(
+                    new Annotation( r->getEString( "name" ),
+                                    r->getEString( "value" ), owner ) );
+        }
+    }
+
+    done = true;
+    List<Fetch>::Iterator i( waiting );
+    while ( i ) {
+        Fetch * f = i;
+        ++i;
+        f->notify();
+    }
+    waiting.clear();
+}
+
 
 /*! \class Fetch fetch.h
 
@@ -169,6 +426,10 @@ Fetch::Fetch( bool f, bool a, bool v, const IntegerSet & set,
     d->vanished = v;
     if ( t )
         setTransaction( t->subTransaction( this ) );
+    else if ( !v && i->session() )
+        d->shared = true;
+    if ( i->session() )
+        d->nextModSeq = i->session()->nextModSeq();
 
     d->peek = true;
 
@@ -247,18 +508,8 @@ void Fetch::parse()
         require( ")" );
     }
     end();
-    if ( d->envelope ) {
-        d->needsHeader = true;
-        d->needsAddresses = true;
-    }
-    if ( d->body || d->bodystructure ) {
-        // message/rfc822 body[structure] includes envelope in some
-        // cases, so we need both here too.
-        d->needsHeader = true;
-        d->needsAddresses = true;
-        // and we even need some data about the bodies
-        d->needsPartNumbers = true;
-    }
+    if ( d->envelope || d->body || d->bodystructure )
+        d->needsStructure = true;
     if ( d->needsBody )
         d->needsHeader = true; // Bodypart::asText() needs mime type etc
     if ( !ok() )
@@ -277,6 +528,8 @@ void Fetch::parse()
         l.append( "trivia" );
     if ( d->needsPartNumbers )
         l.append( "bytes/lines" );
+    if ( d->needsStructure )
+        l.append( "structure" );
     if ( d->annotation )
         l.append( "annotations" );
     log( l.join( " " ) );
@@ -675,7 +928,49 @@ void Fetch::execute()
     if ( !d->peek && s->readOnly() )
         d->peek = true;
 
+    if ( d->state == 0 && d->shared ) {
+        if ( !d->changes ) {
+            d->changes = FetchChanges::find( s->mailbox(), d->changedSince,
+                                             d->nextModSeq, d->annotation );
+            if ( !d->changes->done )
+                d->changes->waiting.append( this );
+        }
+        if ( !d->changes->done )
+            return;
+
+        IntegerSet r( d->set.intersection( session()->messages() ) );
+        d->set.clear();
+        while ( !r.isEmpty() ) {
+            uint uid = r.smallest();
+            r.remove( uid );
+            Message * m = d->changes->messages.find( uid );
+            if ( m ) {
+                d->set.add( uid );
+                d->messages.insert( uid, m );
+                d->dynamics.insert( uid, d->changes->dynamics.find( uid ) );
+            }
+        }
+        d->state = 1;
+    }
+
     if ( d->state == 0 ) {
+        if ( d->needsStructure && !d->useStructures ) {
+            // message_structures holds the downgraded forms, so
+            // clients that accept unicode get freshly computed ones.
+            if ( imap()->clientSupports( IMAP::Unicode ) ) {
+                // message/rfc822 body[structure] includes envelope
+                // in some cases, so we need both here too, and
+                // even some data about the bodies.
+                d->needsHeader = true;
+                d->needsAddresses = true;
+                d->needsPartNumbers = true;
+                d->needsStructure = false;
+            }
+            else {
+                d->useStructures = true;
+            }
+        }
+
         if ( !transaction() &&
              ( !d->peek ||
                ( d->modseq && ( d->flags || d->annotation || d->vanished ) ) ) )
@@ -701,12 +996,14 @@ void Fetch::execute()
                 d->those = new Query( "select uid, message "
                                       "from mailbox_messages "
                                       "where mailbox=$1 and uid=any($2) "
-                                      "and modseq>$3",
+                                      "and modseq>$3 and uid in "
+                                      "(select uid from mailbox_change_log "
+                                      "where mailbox=$1 and modseq>$3)",
                                       this );
                 d->those->bind( 1, s->mailbox()->id() );
                 d->those->bind( 2, d->set );
             }
-            else if ( d->modseq ||
+            else if ( d->modseq || d->needsStructure ||
                       d->needsAddresses || d->needsHeader ||
                       d->needsBody || d->needsPartNumbers ||
                       d->rfc822size || d->internaldate ||
@@ -735,17 +1032,9 @@ void Fetch::execute()
                 if ( d->changedSince )
                     d->those->bind( 3, d->changedSince );
                 if ( d->modseq ) {
-                    if ( !d->peek ) {
-                        // if we aren't peeking, then we have to lock
-                        // the mailbox before we lock the messages,
-                        // otherwise we might deadlock with Store or
-                        // Expunge.
-                        Query * q = new Query( "select nextmodseq "
-                                               "from mailboxes "
-                                               "where id=$1 for update", 0 );
-                        q->bind( 1, mb->id() );
-                        transaction()->enqueue( q );
-                    }
+                    // we lock the messages here. if we aren't
+                    // peeking, Store locks the mailbox later, in the
+                    // same order as everyone else.
                     EString s = d->those->string();
                     s.append( " order by uid for update" );
                     d->those->setString( s );
@@ -838,12 +1127,14 @@ void Fetch::execute()
     if ( d->state == 3 ) {
         d->state = 4;
         sendFetchQueries();
-        if ( d->flags )
-            sendFlagQuery();
-        if ( d->annotation )
-            sendAnnotationsQuery();
-        if ( d->modseq )
-            sendModSeqQuery();
+        if ( !d->changes ) {
+            if ( d->flags )
+                sendFlagQuery();
+            if ( d->annotation )
+                sendAnnotationsQuery();
+            if ( d->modseq )
+                sendModSeqQuery();
+        }
         if ( transaction() )
             transaction()->commit();
     }
@@ -851,6 +1142,11 @@ void Fetch::execute()
     if ( d->state < 4 )
         return;
 
+    if ( d->fetcher && d->fetcher->failed() ) {
+        error( No, "Could not read message data" );
+        return;
+    }
+
     pickup();
 
     if ( d->processed < d->set.largest() )
@@ -894,7 +1190,11 @@ void Fetch::sendFetchQueries()
         l->append( m );
     }
 
+    if ( d->useStructures )
+        sendStructureQuery();
+
     Fetcher * f = new Fetcher( l, this, imap() );
+    d->fetcher = f;
     if ( d->needsAddresses && !haveAddresses )
         f->fetch( Fetcher::Addresses );
     if ( d->needsHeader && !haveHeader )
@@ -1124,12 +1424,16 @@ EString Fetch::makeFetchResponse( Message * m, uint uid, uint msn )
         l.append( "FLAGS (" + flagList( uid ) + ")" );
     if ( d->internaldate )
         l.append( "INTERNALDATE " + internalDate( m ) );
+    FetchData::Structure * st = 0;
+    if ( d->useStructures )
+        st = d->structures.find( m->databaseId() );
     if ( d->envelope )
-        l.append( "ENVELOPE " + envelope( m ) );
+        l.append( "ENVELOPE " + ( st ? st->envelope : envelope( m ) ) );
     if ( d->body )
-        l.append( "BODY " + bodyStructure( m, false ) );
+        l.append( "BODY " + ( st ? st->body : bodyStructure( m, false ) ) );
     if ( d->bodystructure )
-        l.append( "BODYSTRUCTURE " + bodyStructure( m, true ) );
+        l.append( "BODYSTRUCTURE " +
+                  ( st ? st->bodystructure : bodyStructure( m, true ) ) );
     if ( d->annotation )
         l.append( "ANNOTATION " + annotation( imap()->user(), uid,
                                               d->entries, d->attribs ) );
@@ -1167,13 +1471,15 @@ EString Fetch::flagList( uint uid )
 
     FetchData::DynamicData * dd = d->dynamics.find( uid );
     if ( dd ) {
-        if ( session()->isRecent( uid ) )
-            dd->flags.insert( "\\recent", new EString( "\\Recent" ) );
+        // dd may be shared with other sessions, so \Recent, which
+        // is per-session, is added to the list rather than to dd.
         Dict<EString>::Iterator i( dd->flags );
         while ( i ) {
             r.append( *i );
             ++i;
         }
+        if ( session()->isRecent( uid ) && !dd->flags.contains( "\\recent" ) )
+            r.append( "\\Recent" );
     }
 
     return r.join( " " );
@@ -1720,6 +2026,12 @@ void Fetch::pickup()
     if ( d->modseqFetcher && !d->modseqFetcher->done() )
         return;
 
+    if ( d->useStructures && !d->structuresKnown ) {
+        if ( d->structureFetcher && !d->structureFetcher->done() )
+            return;
+        pickupStructures();
+    }
+
     bool ok = true;
     uint done = 0;
     while ( ok && !d->remaining.isEmpty() ) {
@@ -1736,6 +2048,14 @@ void Fetch::pickup()
         if ( ( d->rfc822size || d->internaldate ||
                d->databaseId || d->threadId ) && !m->hasTrivia() )
             ok = false;
+        if ( ok && d->useStructures &&
+             !d->structures.find( m->databaseId() ) ) {
+            if ( !m->hasAddresses() || !m->hasHeaders() ||
+                 !m->hasBytesAndLines() )
+                ok = false;
+            else if ( d->unstructured.contains( m->databaseId() ) )
+                storeStructure( m );
+        }
         if ( ok ) {
             d->processed = uid;
             d->remaining.remove( uid );
@@ -1802,6 +2122,9 @@ void ImapFetchResponse::setSent()
 
 void Fetch::forget( uint uid )
 {
+    Message * m = d->messages.find( uid );
+    if ( m && d->useStructures )
+        d->structures.remove( m->databaseId() );
     d->messages.remove( uid );
 }
 
@@ -1872,6 +2195,107 @@ void Fetch::sendModSeqQuery()
 }
 
 
+/*! Sends a query to retrieve the stored ENVELOPE, BODY and
+    BODYSTRUCTURE for those messages which aren't already complete in
+    RAM. pickupStructures() handles the results.
+*/
+
+void Fetch::sendStructureQuery()
+{
+    IntegerSet ids;
+    Map<Message>::Iterator i( d->messages );
+    while ( i ) {
+        Message * m = i;
+        ++i;
+        if ( m->databaseId() &&
+             !( m->hasAddresses() && m->hasHeaders() &&
+                m->hasBytesAndLines() ) )
+            ids.add( m->databaseId() );
+    }
+    if ( ids.isEmpty() )
+        return;
+
+    d->structureFetcher = new Query(
+        "select message, envelope, body, bodystructure "
+        "from message_structures where message=any($1)",
+        this );
+    d->structureFetcher->bind( 1, ids );
+    enqueue( d->structureFetcher );
+}
+
+
+/*! Records the results of sendStructureQuery(), and starts a Fetcher
+    to retrieve what's necessary to compute the structures of the
+    messages that don't have stored ones yet.
+*/
+
+void Fetch::pickupStructures()
+{
+    while ( d->structureFetcher && d->structureFetcher->hasResults() ) {
+        Row * r = d->structureFetcher->nextRow();
+        FetchData::Structure * st = new FetchData::Structure;
+        st->envelope = r->getEString( "envelope" );
+        st->body = r->getEString( "body" );
+        st->bodystructure = r->getEString( "bodystructure" );
+        d->structures.insert( r->getInt( "message" ), st );
+    }
+    d->structureFetcher = 0;
+    d->structuresKnown = true;
+
+    List<Message> * l = new List<Message>;
+    Map<Message>::Iterator i( d->messages );
+    while ( i ) {
+        Message * m = i;
+        ++i;
+        if ( !d->structures.find( m->databaseId() ) &&
+             !( m->hasAddresses() && m->hasHeaders() &&
+                m->hasBytesAndLines() ) ) {
+            d->unstructured.add( m->databaseId() );
+            l->append( m );
+        }
+    }
+    if ( l->isEmpty() )
+        return;
+
+    log( "Computing structure for " + fn( l->count() ) + " messages",
+         Log::Debug );
+    Fetcher * f = new Fetcher( l, this, imap() );
+    f->fetch( Fetcher::Addresses );
+    f->fetch( Fetcher::OtherHeader );
+    f->fetch( Fetcher::PartNumbers );
+    f->execute();
+}
+
+
+/*! Computes the ENVELOPE, BODY and BODYSTRUCTURE of \a m, which must
+    have its addresses, header and part numbers, and stores them in
+    message_structures, so that later FETCH commands (from this
+    client or others) don't need to fetch all that again.
+*/
+
+void Fetch::storeStructure( Message * m )
+{
+    FetchData::Structure * st = new FetchData::Structure;
+    st->envelope = envelope( m );
+    st->body = bodyStructure( m, false );
+    st->bodystructure = bodyStructure( m, true );
+    d->structures.insert( m->databaseId(), st );
+
+    // another session may have done this concurrently. that's fine.
+    Query * q = new Query( "insert into message_structures "
+                           "(message, envelope, body, bodystructure) "
+                           "select $1, $2, $3, $4 where not exists "
+                           "(select message from message_structures "
+                           "where message=$1)", 0 );
+    q->bind( 1, m->databaseId() );
+    q->bind( 2, st->envelope );
+    q->bind( 3, st->body );
+    q->bind( 4, st->bodystructure );
+    q->allowFailure();
+    q->execute();
+}
+
+
 /*! This helper enqueues \a q for execution, either directly of via a
     transaction.
 */
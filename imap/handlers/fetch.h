@@ -46,6 +46,9 @@ private:
     void sendFlagQuery();
     void sendAnnotationsQuery();
     void sendModSeqQuery();
+    void sendStructureQuery();
+    void pickupStructures();
+    void storeStructure( Message * );
     EString dotLetters( uint, uint );
     EString internalDate( Message * );
     EString envelope( Message * );
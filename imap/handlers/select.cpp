@@ -3,6 +3,7 @@
 #include "select.h"
 
 #include "map.h"
+#include "utf.h"
 #include "imap.h"
 #include "flag.h"
 #include "user.h"
@@ -14,8 +15,10 @@
 #include "mailbox.h"
 #include "imapsession.h"
 #include "permissions.h"
+#include "estringlist.h"
 #include "transaction.h"
 #include "mailboxgroup.h"
+#include "configuration.h"
 
 
 class SelectData
@@ -103,6 +106,58 @@ public:
 static SelectData::FirstUnseenCache * firstUnseenCache = 0;
 
 
+class FirstUnseenFinder
+    : public EventHandler
+{
+public:
+    FirstUnseenFinder( Mailbox * m )
+        : EventHandler(), mailbox( m ), ms( m->nextModSeq() ), q( 0 ) {
+        q = new Query( "select uid from mailbox_messages mm "
+                       "where mailbox=$1 and not seen "
+                       "order by uid limit 1", this );
+        q->bind( 1, m->id() );
+        q->execute();
+    }
+
+    void execute() {
+        if ( !q->done() || q->failed() )
+            return;
+        Row * r = q->nextRow();
+        if ( !r )
+            return;
+        if ( !::firstUnseenCache )
+            ::firstUnseenCache = new SelectData::FirstUnseenCache;
+        ::firstUnseenCache->insert( mailbox, ms, r->getInt( "uid" ) );
+    }
+
+    Mailbox * mailbox;
+    int64 ms;
+    Query * q;
+};
+
+
+/*! Deletes the mailbox_change_log rows for \a mailbox that no longer
+    describe the current state of a message, i.e. those superseded by
+    a later change and those for messages that have been expunged
+    (deleted_messages records those). The trigger that maintains
+    mailbox_change_log only ever inserts rows; this keeps the rows a
+    resync has to read close to the number of changed messages.
+
+    Nobody waits for the result.
+*/
+
+static void compactChanges( uint mailbox )
+{
+    Query * q = new Query( "delete from mailbox_change_log c "
+                           "where c.mailbox=$1 and not exists "
+                           "(select 1 from mailbox_messages mm "
+                           "where mm.mailbox=c.mailbox and mm.uid=c.uid "
+                           "and mm.modseq=c.modseq)", 0 );
+    q->bind( 1, mailbox );
+    q->execute();
+}
+
+
 /*! \class Select select.h
     Opens a mailbox for read-write access (RFC 3501 section 6.3.1)
 
@@ -237,6 +292,9 @@ void Select::execute()
     if ( !::firstUnseenCache )
         ::firstUnseenCache = new SelectData::FirstUnseenCache;
 
+    if ( !d->session && Session::prewarming( d->mailbox, this ) )
+        return;
+
     if ( !d->session ) {
         d->session = new ImapSession( imap(), d->mailbox,
                                       d->readOnly, d->unicode,
@@ -260,8 +318,8 @@ void Select::execute()
         if ( d->knownUids.isEmpty() ) {
             d->updated = new Query( "select uid from deleted_messages "
                                     "where mailbox=$1 and modseq > $2"
-                                    " union "
-                                    "select uid from mailbox_messages "
+                                    " union all "
+                                    "select uid from mailbox_change_log "
                                     "where mailbox=$1 and modseq > $2",
                                     this );
         }
@@ -269,8 +327,8 @@ void Select::execute()
             d->updated = new Query( "select uid from deleted_messages "
                                     "where mailbox=$1 and modseq > $2 "
                                     "and uid=any($3)"
-                                    " union "
-                                    "select uid from mailbox_messages "
+                                    " union all "
+                                    "select uid from mailbox_change_log "
                                     "where mailbox=$1 and modseq > $2 "
                                     "and uid=any($3)",
                                     this );
@@ -302,6 +360,10 @@ void Select::execute()
             Row * r = d->updated->nextRow();
             s.add( r->getInt( "uid" ) );
         }
+        // the same UID may be listed several times; if it often is,
+        // clean up so the next resync has less to read.
+        if ( d->updated->rows() > s.count() + 64 )
+            compactChanges( d->mailbox->id() );
         if ( !s.isEmpty() ) {
             d->firstFetch = new Fetch( true, false, true,
                                        s, d->lastModSeq, imap(),
@@ -363,6 +425,58 @@ void Select::execute()
 }
 
 
+/*! Starts loading what SELECT will need for each of the mailboxes
+    named by the prewarm-mailboxes configuration setting, on behalf of
+    \a user, who has just logged in: the session state (see
+    Session::prewarm()), \a user's permissions and the first unseen
+    message. When the client then selects one of those mailboxes,
+    most or all of the work is already done, and concurrent logins by
+    the same user share it.
+
+    Names are relative to \a user's home directory unless they start
+    with '/', and INBOX means \a user's inbox. Mailboxes that don't
+    exist are ignored.
+*/
+
+void Select::prewarm( User * user )
+{
+    if ( !user || !user->home() )
+        return;
+    EString wanted =
+        Configuration::text( Configuration::PrewarmMailboxes ).simplified();
+    EStringList::Iterator i( EStringList::split( ' ', wanted ) );
+    while ( i ) {
+        EString n( *i );
+        ++i;
+        Mailbox * m = 0;
+        if ( n.isEmpty() ) {
+            // nothing to do
+        }
+        else if ( n.lower() == "inbox" ) {
+            m = user->inbox();
+        }
+        else {
+            Utf8Codec c;
+            UString name;
+            if ( !n.startsWith( "/" ) ) {
+                name = user->home()->name();
+                name.append( "/" );
+            }
+            name.append( c.toUnicode( n ) );
+            if ( c.wellformed() && Mailbox::validName( name ) )
+                m = Mailbox::find( name );
+        }
+        if ( m && !m->deleted() && m->id() && !m->sessions() ) {
+            Session::prewarm( m );
+            (void)new Permissions( m, user, 0 );
+            if ( !::firstUnseenCache ||
+                 !::firstUnseenCache->find( m, m->nextModSeq() ) )
+                (void)new FirstUnseenFinder( m );
+        }
+    }
+}
+
+
 /*! \class Examine select.h
     Opens a mailbox for read-only access (RFC 3501 section 6.3.1)
 
@@ -14,6 +14,8 @@ public:
 
     void parse();
     void execute();
+
+    static void prewarm( class User * );
     
 private:
     void parseQResyncParams();
@@ -21,15 +21,15 @@ public:
         recent( false ), unseen( false ),
         modseq( false ),
         mailbox( 0 ),
-        unseenCount( 0 ), messageCount( 0 ), recentCount( 0 ),
+        counts( 0 ), recentCount( 0 ),
         cacheState( 0 )
         {}
     bool messages, uidnext, uidvalidity, recent, unseen, modseq;
     Mailbox * mailbox;
-    Query * unseenCount;
-    Query * messageCount;
+    Query * counts;
     Query * recentCount;
     uint cacheState;
+    IntegerSet preloaded;
 
     class CacheItem
         : public Garbage
@@ -88,6 +88,28 @@ public:
 static StatusData::StatusCache * cache = 0;
 
 
+/*! Replaces the mailbox_counts rows for \a mailbox with a single row
+    holding their sum. The trigger that maintains mailbox_counts only
+    ever inserts rows, so that concurrent writers never wait for each
+    other; this keeps the number of rows per mailbox small.
+
+    Nobody waits for the result.
+*/
+
+static void mergeCounts( uint mailbox )
+{
+    Query * q = new Query( "with d as ("
+                           "delete from mailbox_counts where mailbox=$1 "
+                           "returning messages, unseen) "
+                           "insert into mailbox_counts "
+                           "(mailbox, messages, unseen) "
+                           "select $1, coalesce(sum(messages),0), "
+                           "coalesce(sum(unseen),0) from d", 0 );
+    q->bind( 1, mailbox );
+    q->execute();
+}
+
+
 /*! \class Status status.h
     Returns the status of the specified mailbox (RFC 3501 section 6.3.10)
 */
@@ -189,10 +211,8 @@ void Status::execute()
 
     // second part. see if anything has happened, and feed the cache if
     // so. make sure we feed the cache at once.
-    if ( d->unseenCount || d->recentCount || d->messageCount ) {
-        if ( d->unseenCount && !d->unseenCount->done() )
-            return;
-        if ( d->messageCount && !d->messageCount->done() )
+    if ( d->counts || d->recentCount ) {
+        if ( d->counts && !d->counts->done() )
             return;
         if ( d->recentCount && !d->recentCount->done() )
             return;
@@ -200,15 +220,19 @@ void Status::execute()
     if ( !::cache )
         ::cache = new StatusData::StatusCache;
 
-    if ( d->unseenCount ) {
-        while ( d->unseenCount->hasResults() ) {
-            Row * r = d->unseenCount->nextRow();
-            StatusData::CacheItem * ci =
-                ::cache->find( r->getInt( "mailbox" ) );
+    if ( d->counts ) {
+        while ( d->counts->hasResults() ) {
+            Row * r = d->counts->nextRow();
+            uint mailbox = r->getInt( "mailbox" );
+            StatusData::CacheItem * ci = ::cache->find( mailbox );
             if ( ci ) {
+                ci->hasMessages = true;
+                ci->messages = r->getInt( "messages" );
                 ci->hasUnseen = true;
                 ci->unseen = r->getInt( "unseen" );
             }
+            if ( r->getInt( "rows" ) > 64 )
+                mergeCounts( mailbox );
         }
     }
     if ( d->recentCount ) {
@@ -222,49 +246,40 @@ void Status::execute()
             }
         }
     }
-    if ( d->messageCount ) {
-        while ( d->messageCount->hasResults() ) {
-            Row * r = d->messageCount->nextRow();
-            StatusData::CacheItem * ci =
-                ::cache->find( r->getInt( "mailbox" ) );
-            if ( ci ) {
-                ci->hasMessages = true;
-                ci->messages = r->getInt( "messages" );
-            }
-        }
-    }
 
     // third part. are we processing the first command in a STATUS
     // loop? if so, see if we ought to preload the cache.
     if ( mailboxGroup() && d->cacheState < 3 ) {
-        IntegerSet mailboxes;
+        IntegerSet & mailboxes = d->preloaded;
         if ( d->cacheState < 1 ) {
             // cache state 0: decide which messages
             List<Mailbox>::Iterator i( mailboxGroup()->contents() );
             while ( i ) {
                 StatusData::CacheItem * ci = ::cache->provide( i );
-                bool need = false;
-                if ( d->unseen || d->recent || d->messages )
-                    need = true;
-                if ( ci->hasUnseen || ci->hasRecent || ci->hasMessages )
-                    need = false;
-                if ( need )
+                if ( ( d->unseen && !ci->hasUnseen ) ||
+                     ( d->recent && !ci->hasRecent ) ||
+                     ( d->messages && !ci->hasMessages ) )
                     mailboxes.add( i->id() );
                 ++i;
             }
             if ( mailboxes.count() < 3 )
                 d->cacheState = 3;
+            else
+                d->cacheState = 1;
         }
         if ( d->cacheState == 1 ) {
             // state 1: send queries
-            if ( d->unseen ) {
-                d->unseenCount
-                    = new Query( "select mailbox, count(uid)::int as unseen "
-                                 "from mailbox_messages "
-                                 "where mailbox=any($1) and not seen "
+            if ( d->unseen || d->messages ) {
+                d->counts
+                    = new Query( "select mailbox, "
+                                 "sum(messages)::int as messages, "
+                                 "sum(unseen)::int as unseen, "
+                                 "count(*)::int as rows "
+                                 "from mailbox_counts "
+                                 "where mailbox=any($1) "
                                  "group by mailbox", this );
-                d->unseenCount->bind( 1, mailboxes );
-                d->unseenCount->execute();
+                d->counts->bind( 1, mailboxes );
+                d->counts->execute();
             }
             if ( d->recent ) {
                 d->recentCount
@@ -274,35 +289,29 @@ void Status::execute()
                 d->recentCount->bind( 1, mailboxes );
                 d->recentCount->execute();
             }
-            if ( d->messages ) {
-                d->messageCount
-                    = new Query( "select count(*)::int as messages, mailbox "
-                                 "from mailbox_messages where mailbox=any($1) "
-                                 "group by mailbox", this );
-                d->messageCount->bind( 1, mailboxes );
-                d->messageCount->execute();
-            }
             d->cacheState = 2;
+            if ( d->counts || d->recentCount )
+                return;
         }
         if ( d->cacheState == 2 ) {
-            // state 2: mark the cache as complete.
-            IntegerSet mailboxes;
-            List<Mailbox>::Iterator i( mailboxGroup()->contents() );
-            while ( i ) {
-                StatusData::CacheItem * ci = ::cache->find( i->id() );
-                if ( ci && d->unseenCount )
+            // state 2: mark the cache as complete for the mailboxes
+            // we asked about.
+            uint n = 1;
+            while ( n <= mailboxes.count() ) {
+                StatusData::CacheItem * ci =
+                    ::cache->find( mailboxes.value( n ) );
+                if ( ci && d->counts ) {
                     ci->hasUnseen = true;
+                    ci->hasMessages = true;
+                }
                 if ( ci && d->recentCount )
                     ci->hasRecent = true;
-                if ( ci && d->messageCount )
-                    ci->hasMessages = true;
-                ++i;
+                ++n;
             }
             // and drop the queries
             d->cacheState = 3;
-            d->unseenCount = 0;
+            d->counts = 0;
             d->recentCount = 0;
-            d->messageCount = 0;
         }
     }
 
@@ -310,14 +319,17 @@ void Status::execute()
     StatusData::CacheItem * i = ::cache->provide( d->mailbox );
 
     // fourth part: send individual queries if there's anything we need
-    if ( d->unseen && !d->unseenCount && !i->hasUnseen ) {
-        d->unseenCount
+    if ( !d->counts &&
+         ( ( d->unseen && !i->hasUnseen ) ||
+           ( d->messages && !i->hasMessages && d->mailbox != current ) ) ) {
+        d->counts
             = new Query( "select $1::int as mailbox, "
-                         "count(uid)::int as unseen "
-                         "from mailbox_messages "
-                         "where mailbox=$1 and not seen", this );
-        d->unseenCount->bind( 1, d->mailbox->id() );
-        d->unseenCount->execute();
+                         "coalesce(sum(messages),0)::int as messages, "
+                         "coalesce(sum(unseen),0)::int as unseen, "
+                         "count(*)::int as rows "
+                         "from mailbox_counts where mailbox=$1", this );
+        d->counts->bind( 1, d->mailbox->id() );
+        d->counts->execute();
     }
 
     if ( !d->recent ) {
@@ -338,28 +350,8 @@ void Status::execute()
         d->recentCount->execute();
     }
 
-    if ( !d->messages ) {
-        // we don't need to collect
-    }
-    else if ( d->mailbox == current ) {
-        // we'll pick it up
-    }
-    else if ( i->hasMessages ) {
-        // the cache has it
-    }
-    else if ( d->messages && !d->messageCount ) {
-        d->messageCount
-            = new Query( "select count(*)::int as messages, "
-                         "$1::int as mailbox "
-                         "from mailbox_messages where mailbox=$1", this );
-        d->messageCount->bind( 1, d->mailbox->id() );
-        d->messageCount->execute();
-    }
-
-    if ( d->unseenCount || d->recentCount || d->messageCount ) {
-        if ( d->unseenCount && !d->unseenCount->done() )
-            return;
-        if ( d->messageCount && !d->messageCount->done() )
+    if ( d->counts || d->recentCount ) {
+        if ( d->counts && !d->counts->done() )
             return;
         if ( d->recentCount && !d->recentCount->done() )
             return;
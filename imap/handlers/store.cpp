@@ -3,6 +3,8 @@
 #include "store.h"
 
 #include "helperrowcreator.h"
+#include "configuration.h"
+#include "allocator.h"
 #include "messagecache.h"
 #include "permissions.h"
 #include "transaction.h"
@@ -23,6 +25,265 @@
 #include "map.h"
 
 
+class FlagChange
+    : public Garbage
+{
+public:
+    FlagChange()
+        : changeSeen( false ), changeDeleted( false ),
+          newSeen( false ), newDeleted( false ),
+          silent( false ), session( 0 ), owner( 0 ),
+          done( false ), failed( false ), modseq( 0 ), offset( 0 )
+    {}
+
+    bool sameUpdate( const FlagChange * other ) const {
+        return changeSeen == other->changeSeen &&
+            changeDeleted == other->changeDeleted &&
+            ( !changeSeen || newSeen == other->newSeen ) &&
+            ( !changeDeleted || newDeleted == other->newDeleted ) &&
+            silent == other->silent &&
+            ( !silent || session == other->session );
+    }
+
+    IntegerSet uids;
+    bool changeSeen;
+    bool changeDeleted;
+    bool newSeen;
+    bool newDeleted;
+    bool silent;
+    ImapSession * session;
+    EventHandler * owner;
+    bool done;
+    bool failed;
+    int64 modseq;
+    uint offset;
+};
+
+
+class FlagWriter
+    : public EventHandler
+{
+public:
+    FlagWriter( Mailbox * m )
+        : EventHandler(), mailbox( m ), t( 0 ), lock( 0 ),
+          nextModSeq( 0 ), offset( 0 ) {}
+
+    static void add( Mailbox *, FlagChange * );
+
+    void execute();
+    void flush();
+
+    Mailbox * mailbox;
+    List<FlagChange> queued;
+    List<FlagChange> flying;
+    Transaction * t;
+    Query * lock;
+    List<Query> writes;
+    int64 nextModSeq;
+    uint offset;
+};
+
+
+static Map<FlagWriter> * writers = 0;
+static List<FlagWriter> * held = 0;
+static uint batches = 0;
+
+
+/*! Queues \a c for writing to \a m. If nothing is being written to
+    \a m at the moment, \a c is written at once, otherwise when the
+    current write finishes, together with any other changes that
+    arrive meanwhile.
+
+    Between Store::beginBatch() and Store::endBatch(), \a c is only
+    queued, so that all the changes made by pipelined commands are
+    written together.
+*/
+
+void FlagWriter::add( Mailbox * m, FlagChange * c )
+{
+    if ( !writers ) {
+        writers = new Map<FlagWriter>;
+        Allocator::addEternal( writers, "flag writers" );
+    }
+    FlagWriter * w = writers->find( m->id() );
+    if ( !w ) {
+        w = new FlagWriter( m );
+        writers->insert( m->id(), w );
+    }
+    w->queued.append( c );
+    if ( w->t )
+        return;
+    if ( !batches ) {
+        w->flush();
+        return;
+    }
+    if ( !held ) {
+        held = new List<FlagWriter>;
+        Allocator::addEternal( held, "flag writers in a batch" );
+    }
+    if ( !held->find( w ) )
+        held->append( w );
+}
+
+
+/*! Writes all the queued changes to the database in one
+    transaction. Changes which update the same columns in the same way
+    are merged into a single update, and each such update gets its own
+    modseq, so that silent changes can be told apart from others. An
+    update which changes no rows doesn't use up a modseq.
+
+    The messages are locked before the mailbox, as in Store.
+*/
+
+void FlagWriter::flush()
+{
+    flying.clear();
+    IntegerSet all;
+    List<FlagChange>::Iterator c( queued );
+    while ( c ) {
+        all.add( c->uids );
+        flying.append( c );
+        ++c;
+    }
+    queued.clear();
+
+    t = new Transaction( this );
+
+    Query * q = new Query( "select uid from mailbox_messages "
+                           "where mailbox=$1 and uid=any($2) "
+                           "order by uid for update", 0 );
+    q->bind( 1, mailbox->id() );
+    q->bind( 2, all );
+    t->enqueue( q );
+
+    lock = new Query( "select nextmodseq from mailboxes "
+                      "where id=$1 for update", this );
+    lock->bind( 1, mailbox->id() );
+    t->enqueue( lock );
+
+    List<FlagChange> updates;
+    c = flying.first();
+    while ( c ) {
+        List<FlagChange>::Iterator u( updates );
+        while ( u && !u->sameUpdate( c ) )
+            ++u;
+        if ( u ) {
+            u->uids.add( c->uids );
+            c->offset = u->offset;
+        }
+        else {
+            FlagChange * f = new FlagChange( *c );
+            f->offset = updates.count();
+            c->offset = f->offset;
+            updates.append( f );
+        }
+        ++c;
+    }
+
+    writes.clear();
+    offset = 0;
+    c = updates.first();
+    while ( c ) {
+        EString s( "update mailbox_messages set modseq="
+                   "(select nextmodseq from mailboxes where id=$1)" );
+        EStringList conditions;
+        if ( c->changeSeen ) {
+            if ( c->newSeen ) {
+                s.append( ",seen=true" );
+                conditions.append( "not seen" );
+            }
+            else {
+                s.append( ",seen=false" );
+                conditions.append( "seen" );
+            }
+        }
+        if ( c->changeDeleted ) {
+            if ( c->newDeleted ) {
+                s.append( ",deleted=true" );
+                conditions.append( "not deleted" );
+            }
+            else {
+                s.append( ",deleted=false" );
+                conditions.append( "deleted" );
+            }
+        }
+        s.append( " where mailbox=$1 and uid=any($2) and (" );
+        s.append( conditions.join( " or " ) );
+        s.append( ")" );
+        q = new Query( s, this );
+        q->bind( 1, mailbox->id() );
+        q->bind( 2, c->uids );
+        t->enqueue( q );
+        writes.append( q );
+
+        // as in Store, an update which changed nothing shouldn't
+        // consume a modseq.
+        q = new Query( "update mailboxes "
+                       "set nextmodseq=nextmodseq+1 "
+                       "where id=$1 and exists "
+                       "(select uid from mailbox_messages "
+                       "where mailbox=$1 and uid=any($2) "
+                       "and modseq=mailboxes.nextmodseq)", 0 );
+        q->bind( 1, mailbox->id() );
+        q->bind( 2, c->uids );
+        t->enqueue( q );
+        ++c;
+    }
+
+    Mailbox::refreshMailboxes( t );
+    t->commit();
+}
+
+
+void FlagWriter::execute()
+{
+    if ( !t )
+        return;
+
+    if ( lock && lock->hasResults() ) {
+        nextModSeq = lock->nextRow()->getBigint( "nextmodseq" );
+        lock = 0;
+    }
+
+    // each update that changed any rows used the next modseq
+    while ( !lock && !writes.isEmpty() &&
+            writes.firstElement()->done() ) {
+        Query * q = writes.shift();
+        if ( q->rows() ) {
+            List<FlagChange>::Iterator c( flying );
+            while ( c ) {
+                if ( c->offset == offset ) {
+                    c->modseq = nextModSeq;
+                    if ( c->silent )
+                        c->session->ignoreModSeq( c->modseq );
+                }
+                ++c;
+            }
+            nextModSeq++;
+        }
+        offset++;
+    }
+
+    if ( !t->done() )
+        return;
+
+    bool failed = t->failed();
+    t = 0;
+    List<FlagChange>::Iterator c( flying );
+    while ( c ) {
+        FlagChange * f = c;
+        ++c;
+        f->done = true;
+        f->failed = failed;
+        f->owner->notify();
+    }
+    flying.clear();
+
+    if ( !queued.isEmpty() )
+        flush();
+}
+
+
 class StoreData
     : public Garbage
 {
@@ -40,7 +301,7 @@ public:
           annotationNameCreator( 0 ), session( 0 ),
           changeSeen( false ), changeDeleted( false ),
           newSeen( false ), newDeleted( false ),
-          sentNextModSeq( false ), modseqUpdate( 0 )
+          modseqUpdate( 0 ), change( 0 )
     {}
     IntegerSet specified;
     IntegerSet s;
@@ -77,8 +338,8 @@ public:
     bool newDeleted;
     IntegerSet changedUids;
 
-    bool sentNextModSeq;
     Query * modseqUpdate;
+    FlagChange * change;
 };
 
 
@@ -97,6 +358,25 @@ public:
     order, and the x flag on message 1 may have any value afterwards.
     Generally, the second command's finished last, because of how the
     database does locking.
+
+    If group-flag-commits is enabled, commands which only set or clear
+    \seen and/or \deleted are handed to a per-mailbox writer instead
+    of using a Transaction each. While one such write is in progress,
+    the writer collects changes from all sessions in this process, and
+    writes them all in one transaction when the first finishes. Each
+    command is acknowledged only after its write has been committed.
+    Pipelined STORE commands from one client are handled the same way
+    even if group-flag-commits is disabled, and changes which alter
+    the same flags the same way share a single update.
+
+    Store locks the affected mailbox_messages rows first, and the
+    mailboxes row (which holds nextmodseq) only at the very end, just
+    before committing. Thus several clients can work on different
+    messages in the same mailbox concurrently, and they serialise only
+    while allocating a modseq. Since the modseq is allocated under the
+    mailbox lock and committed at once, modseqs become visible in
+    order, as CONDSTORE requires. Anything else that locks both must
+    use the same order.
 */
 
 /*! Constructs a Store handler. If \a u is set, the first argument is
@@ -370,16 +650,50 @@ void Store::execute()
     if ( !ok() || !permitted() )
         return;
 
-    if ( !d->obtainModSeq ) {
+    if ( !d->findSet && !d->change && !transaction() &&
+         !d->seenUnchangedSince && !d->flagNames.isEmpty() &&
+         ( d->op == StoreData::AddFlags ||
+           d->op == StoreData::RemoveFlags ) &&
+         ( Configuration::toggle( Configuration::GroupFlagCommits ) ||
+           pipelined() ) ) {
+        bool other = false;
+        EStringList::Iterator it( d->flagNames );
+        while ( it ) {
+            EString f = it->lower();
+            if ( f != "\\seen" && f != "\\deleted" )
+                other = true;
+            ++it;
+        }
+        if ( !other ) {
+            FlagChange * c = new FlagChange;
+            c->uids = d->specified;
+            c->changeSeen = d->seen;
+            c->newSeen = d->op == StoreData::AddFlags;
+            c->changeDeleted = d->deleted;
+            c->newDeleted = d->op == StoreData::AddFlags;
+            c->silent = d->silent;
+            c->session = d->session;
+            c->owner = this;
+            d->change = c;
+            FlagWriter::add( m, c );
+        }
+    }
+
+    if ( d->change ) {
+        if ( !d->change->done )
+            return;
+        if ( d->change->failed )
+            error( No, "Database error. Rolling transaction back" );
+        else if ( !d->silent && !d->expunged.isEmpty() )
+            error( No, "Cannot store on expunged messages" );
+        finish();
+        return;
+    }
+
+    if ( !d->findSet ) {
         if ( !transaction() )
             setTransaction( new Transaction( this ) );
 
-        d->obtainModSeq
-            = new Query( "select nextmodseq from mailboxes "
-                         "where id=$1 for update", this );
-        d->obtainModSeq->bind( 1, m->id() );
-        transaction()->enqueue( d->obtainModSeq );
-
         Selector * work = new Selector;
         work->add( new Selector( d->specified ) );
         if ( d->seenUnchangedSince )
@@ -504,22 +818,21 @@ void Store::execute()
         transaction()->execute();
     }
 
-    if ( !d->obtainModSeq->done() )
-        return;
-
-    if ( !d->modseq ) {
-        Row * r = d->obtainModSeq->nextRow();
-        if ( !r ) {
-            error( No, "Could not obtain modseq" );
-            return;
-        }
-        d->modseq = r->getBigint( "nextmodseq" );
+    if ( !d->obtainModSeq ) {
+        // now that the messages are locked and the flags are in
+        // place, lock the mailbox, allocate a modseq and commit at
+        // once, so the mailbox row is held as briefly as possible.
+        d->obtainModSeq
+            = new Query( "select nextmodseq from mailboxes "
+                         "where id=$1 for update", this );
+        d->obtainModSeq->bind( 1, m->id() );
+        transaction()->enqueue( d->obtainModSeq );
 
         d->modseqUpdate = new Query( "", this );
-        d->modseqUpdate->bind( 1, d->modseq );
-        d->modseqUpdate->bind( 2, m->id() );
-        d->modseqUpdate->bind( 3, d->s );
-        EString uq(  "update mailbox_messages set modseq=$1" );
+        d->modseqUpdate->bind( 1, m->id() );
+        d->modseqUpdate->bind( 2, d->s );
+        EString uq( "update mailbox_messages set modseq="
+                    "(select nextmodseq from mailboxes where id=$1)" );
         if ( d->changeSeen ) {
             uq.append( ",seen=" );
             if ( d->newSeen )
@@ -534,7 +847,7 @@ void Store::execute()
             else
                 uq.append( "false" );
         }
-        uq.append( " where mailbox=$2 and uid=any($3)" );
+        uq.append( " where mailbox=$1 and uid=any($2)" );
         EStringList extraConditions;
         bool checkSeenDeleted = true;
         if ( d->changedUids.isEmpty() ) {
@@ -548,8 +861,8 @@ void Store::execute()
         else {
             // we change flags on some messages, but maybe
             // seen/deleted on more?
-            extraConditions.append( "uid=any($4)" );
-            d->modseqUpdate->bind( 4, d->changedUids );
+            extraConditions.append( "uid=any($3)" );
+            d->modseqUpdate->bind( 3, d->changedUids );
         }
         if ( checkSeenDeleted ) {
             if ( d->changeSeen ) {
@@ -579,34 +892,29 @@ void Store::execute()
         }
         d->modseqUpdate->setString( uq );
         transaction()->enqueue( d->modseqUpdate );
-        transaction()->execute();
-    }
 
-    if ( !d->modseqUpdate->done() )
-        return;
-
-    if ( !d->sentNextModSeq ) {
-        if ( !d->modseqUpdate->rows() ) {
-            // we updated zero mailbox_messages rows, so we also
-            // should not consume a modseq.
-            transaction()->commit();
-            finish();
-            return;
-        }
-        d->sentNextModSeq = true;
-
-        Query * q = new Query( "update mailboxes set nextmodseq=$1 "
-                               "where id=$2", 0 );
-        q->bind( 1, d->modseq + 1 );
-        q->bind( 2, m->id() );
+        // if we updated zero mailbox_messages rows, then we also
+        // should not consume a modseq.
+        Query * q = new Query( "update mailboxes "
+                               "set nextmodseq=nextmodseq+1 "
+                               "where id=$1 and exists "
+                               "(select uid from mailbox_messages "
+                               "where mailbox=$1 and uid=any($2) "
+                               "and modseq=mailboxes.nextmodseq)", 0 );
+        q->bind( 1, m->id() );
+        q->bind( 2, d->s );
         transaction()->enqueue( q );
 
-        if ( d->silent )
-            d->session->ignoreModSeq( d->modseq );
         Mailbox::refreshMailboxes( transaction() );
         transaction()->commit();
     }
 
+    if ( !d->modseq && d->obtainModSeq->hasResults() ) {
+        d->modseq = d->obtainModSeq->nextRow()->getBigint( "nextmodseq" );
+        if ( d->silent )
+            d->session->ignoreModSeq( d->modseq );
+    }
+
     if ( !transaction()->done() )
         return;
     if ( transaction()->failed() ) {
@@ -615,6 +923,11 @@ void Store::execute()
         return;
     }
 
+    if ( !d->modseqUpdate->rows() ) {
+        finish();
+        return;
+    }
+
     if ( d->silent && d->seenUnchangedSince ) {
         uint n = 0;
         while ( n < d->s.count() ) {
@@ -895,3 +1208,57 @@ EString Store::entryName()
         error( Bad, "Annotation entries are all-ASCII" );
     return r.ascii();
 }
+
+
+/*! Returns true if the client has sent another STORE which hasn't
+    finished yet, so that this command is one of a pipelined run.
+*/
+
+bool Store::pipelined() const
+{
+    List<Command>::Iterator c( imap()->commands() );
+    while ( c ) {
+        if ( c != this && c->state() < Command::Finished &&
+             ( c->name() == "store" || c->name() == "uid store" ) )
+            return true;
+        ++c;
+    }
+    return false;
+}
+
+
+/*! Starts collecting \seen and \deleted changes instead of writing
+    them at once. IMAP::runCommands() calls this before it runs the
+    commands which are ready, and endBatch() afterwards, so that a run
+    of pipelined STORE commands is written to each mailbox with one
+    transaction.
+
+    Calls may be nested.
+*/
+
+void Store::beginBatch()
+{
+    batches++;
+}
+
+
+/*! Ends the batch started by beginBatch() and writes the changes
+    collected meanwhile.
+*/
+
+void Store::endBatch()
+{
+    if ( !batches )
+        return;
+    batches--;
+    if ( batches || !held )
+        return;
+
+    List<FlagWriter>::Iterator w( held );
+    while ( w ) {
+        FlagWriter * f = w;
+        held->take( w );
+        if ( !f->t && !f->queued.isEmpty() )
+            f->flush();
+    }
+}
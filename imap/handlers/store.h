@@ -20,10 +20,14 @@ public:
     void parse();
     void execute();
 
+    static void beginBatch();
+    static void endBatch();
+
 private:
     class StoreData * d;
 
 private:
+    bool pipelined() const;
     bool processFlagNames();
     bool processAnnotationNames();
     bool removeFlags( bool opposite = false );
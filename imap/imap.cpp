@@ -16,6 +16,8 @@
 #include "imapsession.h"
 #include "configuration.h"
 #include "handlers/capability.h"
+#include "handlers/select.h"
+#include "handlers/store.h"
 #include "mailboxgroup.h"
 #include "imapparser.h"
 #include "database.h"
@@ -472,6 +474,7 @@ void IMAP::setUser( User * user, const EString & mechanism )
          mechanism, Log::Significant );
     SaslConnection::setUser( user, mechanism );
     setState( Authenticated );
+    Select::prewarm( user );
 
     bool possiblyOutlook = true;
     List< Command >::Iterator i( d->commands );
@@ -530,8 +533,10 @@ void IMAP::runCommands()
         log( "IMAP::runCommands, " + fn( d->commands.count() ) + " commands",
              Log::Debug );
 
-        // run all currently executing commands once
+        // run all currently executing commands once, letting them
+        // combine their flag changes
         uint n = 0;
+        Store::beginBatch();
         List< Command >::Iterator i( d->commands );
         while ( i ) {
             Command * c = i;
@@ -545,6 +550,7 @@ void IMAP::runCommands()
                 n++;
             }
         }
+        Store::endBatch();
 
         // emit responses for zero or more finished commands and
         // retire them.
@@ -12,6 +12,10 @@
 
     This subclass of AbnfParser provides functions like nil(), string(),
     and literal() for use by IMAP and individual IMAP Commands.
+
+    Where possible, the strings returned share storage with the input
+    (see EString::mid()), so parsing a typical command allocates little
+    more than the EString objects themselves.
 */
 
 /*! Creates a new ImapParser for the string \a s.
@@ -47,17 +51,17 @@ EString ImapParser::firstLine()
 
 EString ImapParser::tag()
 {
-    EString r;
-
+    uint start = pos();
     char c = nextChar();
     while ( c > ' ' && c < 127 && c != '(' && c != ')' && c != '{' &&
             c != '%' && c != '*' && c != '"' && c != '\\' && c != '+' )
     {
         step();
-        r.append( c );
         c = nextChar();
     }
 
+    EString r( str.mid( start, pos() - start ) );
+
     if ( r.isEmpty() )
         setError( "Expected IMAP tag, but saw: " + following().quoted() );
 
@@ -73,21 +77,19 @@ EString ImapParser::tag()
 
 EString ImapParser::command()
 {
-    EString r;
-
-    if ( present( "uid " ) )
-        r.append( "uid " );
+    uint start = pos();
+    bool uid = present( "uid " );
 
     char c = nextChar();
     while ( c > ' ' && c < 127 && c != '(' && c != ')' && c != '{' &&
             c != '%' && c != '*' && c != '"' && c != '\\' && c != ']' )
     {
         step();
-        r.append( c );
         c = nextChar();
     }
 
-    if ( r.isEmpty() || r == "uid " )
+    EString r( str.mid( start, pos() - start ) );
+    if ( r.isEmpty() || ( uid && r.length() == 4 ) )
         setError( "Expected IMAP command name, but saw: '" +
                   following() + "'" );
 
@@ -117,18 +119,18 @@ uint ImapParser::nzNumber()
 
 EString ImapParser::atom()
 {
-    EString r;
-
+    uint start = pos();
     char c = nextChar();
     while ( c > ' ' && c < 127 &&
             c != '(' && c != ')' && c != '{' && c != ']' &&
             c != '"' && c != '\\' && c != '%' && c != '*' )
     {
         step();
-        r.append( c );
         c = nextChar();
     }
 
+    EString r( str.mid( start, pos() - start ) );
+
     if ( r.isEmpty() )
         setError( "Expected IMAP atom, but saw: " + following() );
 
@@ -144,17 +146,17 @@ EString ImapParser::atom()
 
 EString ImapParser::listChars()
 {
-    EString r;
-
+    uint start = pos();
     char c = nextChar();
     while ( c > ' ' && c < 127 && c != '(' && c != ')' && c != '{' &&
             c != '"' && c != '\\' )
     {
         step();
-        r.append( c );
         c = nextChar();
     }
 
+    EString r( str.mid( start, pos() - start ) );
+
     if ( r.isEmpty() )
         setError( "Expected 1*list-char, but saw: " + following() );
 
@@ -190,25 +192,41 @@ EString ImapParser::quoted()
     }
 
     step();
+    uint start = pos();
+    bool escaped = false;
+    bool ascii = true;
     c = nextChar();
     while ( c != '"' && c > 0 && c != 10 && c != 13 ) {
         if ( c == '\\' ) {
+            if ( !escaped ) {
+                escaped = true;
+                r = str.mid( start, pos() - start );
+            }
             step();
             c = nextChar();
             if ( c == 0 || c == 10 || c == 13 )
                 setError( "Quoted string contained bad char: " +
                           following() );
         }
+        if ( (uint)(unsigned char)c > 127 )
+            ascii = false;
         step();
-        r.append( c );
+        if ( escaped )
+            r.append( c );
         c = nextChar();
     }
 
+    if ( !escaped )
+        r = str.mid( start, pos() - start );
+
     if ( c != '"' )
         setError( "Quoted string incorrectly terminated: " + following() );
     else
         step();
 
+    if ( ascii )
+        return r;
+
     Utf8Codec utf8;
     UString u( utf8.toUnicode( r ) );
 
@@ -310,17 +328,18 @@ EString ImapParser::astring()
     if ( c == '"' || c == '{' )
         return string();
 
-    EString r;
+    uint start = pos();
     while ( c > ' ' && c < 128 &&
             c != '(' && c != ')' && c != '{' &&
             c != '"' && c != '\\' &&
             c != '%' && c != '*' )
     {
         step();
-        r.append( c );
         c = nextChar();
     }
 
+    EString r( str.mid( start, pos() - start ) );
+
     if ( r.isEmpty() )
         setError( "Expected astring, but saw: " + following() );
 
@@ -336,21 +355,21 @@ EString ImapParser::astring()
 
 EString ImapParser::listMailbox()
 {
-    EString r;
-
     char c = nextChar();
     if ( c == '"' || c == '{' )
         return string();
 
+    uint start = pos();
     while ( c > ' ' &&
             c != '(' && c != ')' && c != '{' &&
             c != '"' && c != '\\' )
     {
         step();
-        r.append( c );
         c = nextChar();
     }
 
+    EString r( str.mid( start, pos() - start ) );
+
     if ( r.isEmpty() )
         setError( "Expected list-mailbox, but saw: " + following() );
 
@@ -386,7 +405,7 @@ EString ImapParser::flag()
 
 EString ImapParser::dotLetters( uint min, uint max )
 {
-    EString r;
+    uint start = pos();
     uint i = 0;
     char c = nextChar();
     while ( i < max &&
@@ -394,11 +413,12 @@ EString ImapParser::dotLetters( uint min, uint max )
               ( c >= '0' && c <= '9' ) || ( c == '.' ) ) )
     {
         step();
-        r.append( c );
         c = nextChar();
         i++;
     }
 
+    EString r( str.mid( start, i ) );
+
     if ( i < min )
         setError( "Expected at least " + fn( min-i ) + " more "
                   "letters/digits/dots, but saw: " + following() );
@@ -424,6 +424,17 @@ void ImapUrlFetcher::execute()
             ++f;
         }
 
+        List<Fetcher>::Iterator ff( d->fetchers );
+        while ( ff ) {
+            if ( ff->failed() ) {
+                setError( "could not read message data",
+                          d->urls->firstElement()->url->orig() );
+                d->owner->execute();
+                return;
+            }
+            ++ff;
+        }
+
         List<UrlLink>::Iterator it( d->urls );
         while ( it ) {
             if ( !it->message ) {
@@ -0,0 +1,253 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+// open, fstat
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+// pread, close, unlink
+#include <unistd.h>
+// rename
+#include <stdio.h>
+// utime
+#include <utime.h>
+// time
+#include <time.h>
+// opendir
+#include <dirent.h>
+
+#include "blobstore.h"
+
+#include "configuration.h"
+#include "allocator.h"
+#include "file.h"
+#include "md5.h"
+#include "log.h"
+
+#if !defined(O_LARGEFILE)
+#define O_LARGEFILE 0
+#endif
+
+
+/*! \class BlobStore blobstore.h
+
+    The BlobStore class keeps large bodyparts in the filesystem
+    instead of in the bodyparts table.
+
+    If blob-directory is set, the Injector hands every non-text
+    bodypart larger than blob-threshold to store(). The file is named
+    by the MD5 hash of its contents (which the bodyparts table
+    already records), so identical bodyparts share a file, and only
+    the hash and length are kept in the database, with
+    bodyparts.blob set. The Fetcher reads the data back with
+    contents().
+
+    Files are written before the injecting transaction commits. If
+    the transaction fails, the file is left behind and removed by
+    removeUnused(), which "aox vacuum" calls after it deletes unused
+    bodyparts.
+
+    All functions are static; there are no BlobStore objects.
+*/
+
+
+/*! Returns true if blob-directory is set, and false if all bodyparts
+    should be stored in the database.
+*/
+
+bool BlobStore::enabled()
+{
+    return !Configuration::text( Configuration::BlobDirectory ).isEmpty();
+}
+
+
+/*! Returns true if a bodypart of \a size bytes should be stored in
+    the blob directory, and false if it belongs in the database.
+*/
+
+bool BlobStore::suitable( uint size )
+{
+    if ( !enabled() )
+        return false;
+    return size >= Configuration::scalar( Configuration::BlobThreshold );
+}
+
+
+/*! Returns the name of the file used for the blob whose hex-encoded
+    MD5 hash is \a hash. The first two hash digits are used as a
+    subdirectory, so no single directory becomes too large.
+*/
+
+EString BlobStore::fileName( const EString & hash )
+{
+    EString n = Configuration::text( Configuration::BlobDirectory );
+    if ( !n.endsWith( "/" ) )
+        n.append( "/" );
+    n.append( hash.mid( 0, 2 ) );
+    n.append( "/" );
+    n.append( hash );
+    return n;
+}
+
+
+/*! Writes \a data to the file for \a hash, unless that file already
+    exists. Returns true if the file exists afterwards, and false if
+    the data could not be written (in which case the caller should
+    store it in the database instead).
+
+    The data is written to a temporary file first and then renamed
+    into place, so a concurrent reader never sees a partial blob.
+*/
+
+bool BlobStore::store( const EString & hash, const EString & data )
+{
+    EString name = File::chrooted( fileName( hash ) );
+
+    // if we already have it, we touch it so removeUnused() won't
+    // consider it stale until the new reference has been committed.
+    struct stat st;
+    if ( ::stat( name.cstr(), &st ) == 0 &&
+         (uint)st.st_size == data.length() &&
+         ::utime( name.cstr(), 0 ) == 0 )
+        return true;
+
+    EString dir = name.mid( 0, name.length() - hash.length() - 1 );
+    ::mkdir( dir.cstr(), 0700 );
+
+    EString tmp = name + "." + fn( getpid() );
+    int fd = ::open( tmp.cstr(), O_WRONLY|O_CREAT|O_TRUNC|O_LARGEFILE,
+                     0600 );
+    if ( fd < 0 ) {
+        log( "Could not create " + tmp, Log::Error );
+        return false;
+    }
+
+    uint done = 0;
+    while ( done < data.length() ) {
+        int r = ::write( fd, data.data() + done, data.length() - done );
+        if ( r <= 0 )
+            break;
+        done += r;
+    }
+    bool ok = ( done == data.length() );
+    if ( ::close( fd ) < 0 )
+        ok = false;
+    if ( ok && ::rename( tmp.cstr(), name.cstr() ) < 0 )
+        ok = false;
+    if ( !ok ) {
+        log( "Could not write blob " + name, Log::Error );
+        ::unlink( tmp.cstr() );
+    }
+    return ok;
+}
+
+
+/*! Reads the blob for \a hash into \a data and returns true, or
+    returns false (and leaves \a data alone) if the blob cannot be
+    read in its entirety.
+
+    The file is read with pread() into a single buffer, so there is
+    no intermediate copy.
+*/
+
+bool BlobStore::contents( const EString & hash, EString * data )
+{
+    EString name = File::chrooted( fileName( hash ) );
+    int fd = ::open( name.cstr(), O_RDONLY|O_LARGEFILE );
+    if ( fd < 0 ) {
+        log( "Could not open blob " + name, Log::Error );
+        return false;
+    }
+
+    struct stat st;
+    if ( fstat( fd, &st ) < 0 ) {
+        ::close( fd );
+        log( "Could not stat blob " + name, Log::Error );
+        return false;
+    }
+
+    uint size = st.st_size;
+    char * b = (char *)Allocator::alloc( size + 1, 0 );
+    uint done = 0;
+    while ( done < size ) {
+        int r = ::pread( fd, b + done, size - done, done );
+        if ( r <= 0 )
+            break;
+        done += r;
+    }
+    ::close( fd );
+    if ( done < size ) {
+        log( "Could not read blob " + name, Log::Error );
+        return false;
+    }
+
+    b[size] = '\0';
+    *data = EString( b, size );
+    return true;
+}
+
+
+/*! Returns true if the blob for \a hash exists, is \a bytes long and
+    has the right MD5 hash, and false if it is missing or damaged.
+*/
+
+bool BlobStore::verify( const EString & hash, uint bytes )
+{
+    EString data;
+    if ( !contents( hash, &data ) )
+        return false;
+    if ( data.length() != bytes )
+        return false;
+    return MD5::hash( data ).hex() == hash;
+}
+
+
+/*! Removes every blob whose hash is not in \a used, and returns the
+    number of files removed. Temporary files left by store() are
+    removed too.
+
+    This is meant to be called by "aox vacuum" after unused bodyparts
+    have been deleted. Files modified during the last hour are left
+    alone, since they may belong to an injection that hasn't committed
+    yet.
+*/
+
+uint BlobStore::removeUnused( const Dict<EString> & used )
+{
+    uint removed = 0;
+    EString root = File::chrooted(
+        Configuration::text( Configuration::BlobDirectory ) );
+    if ( !root.endsWith( "/" ) )
+        root.append( "/" );
+
+    DIR * top = opendir( root.cstr() );
+    if ( !top )
+        return 0;
+
+    time_t cutoff = time( 0 ) - 3600;
+
+    struct dirent * t;
+    while ( ( t = readdir( top ) ) != 0 ) {
+        EString sub( t->d_name );
+        if ( sub.length() != 2 || !sub.boring() )
+            continue;
+        EString dir = root + sub + "/";
+        DIR * d = opendir( dir.cstr() );
+        if ( !d )
+            continue;
+        struct dirent * e;
+        while ( ( e = readdir( d ) ) != 0 ) {
+            EString n( e->d_name );
+            if ( n.startsWith( "." ) || used.contains( n ) )
+                continue;
+            EString f = dir + n;
+            struct stat st;
+            if ( ::stat( f.cstr(), &st ) < 0 || st.st_mtime > cutoff )
+                continue;
+            if ( ::unlink( f.cstr() ) == 0 )
+                removed++;
+        }
+        closedir( d );
+    }
+    closedir( top );
+    return removed;
+}
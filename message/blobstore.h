@@ -0,0 +1,27 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef BLOBSTORE_H
+#define BLOBSTORE_H
+
+#include "estring.h"
+#include "dict.h"
+
+
+class BlobStore
+    : public Garbage
+{
+public:
+    static bool enabled();
+    static bool suitable( uint );
+
+    static EString fileName( const EString & );
+
+    static bool store( const EString &, const EString & );
+    static bool contents( const EString &, EString * );
+    static bool verify( const EString &, uint );
+
+    static uint removeUnused( const Dict<EString> & );
+};
+
+
+#endif
@@ -7,6 +7,7 @@
 #include "integerset.h"
 #include "allocator.h"
 #include "bodypart.h"
+#include "blobstore.h"
 #include "selector.h"
 #include "postgres.h"
 #include "mailbox.h"
@@ -15,12 +16,13 @@
 #include "buffer.h"
 #include "query.h"
 #include "scope.h"
+#include "graph.h"
 #include "timer.h"
 #include "utf.h"
 #include "map.h"
 #include "log.h"
 
-#include <time.h> // time()
+#include <sys/time.h> // gettimeofday, struct timeval
 
 
 enum State { NotStarted, Fetching, Done };
@@ -39,7 +41,6 @@ public:
           maxBatchSize( 32768 ),
           batchSize( 0 ),
           uniqueDatabaseIds( true ),
-          lastBatchStarted( 0 ),
           addresses( 0 ), otherheader( 0 ),
           body( 0 ), trivia( 0 ),
           partnumbers( 0 ),
@@ -48,6 +49,7 @@ public:
 
     List<Message> messages;
     Map< List<Message> > batch;
+    List<Query> awaited;
     EventHandler * owner;
     List<Query> * q;
     Transaction * transaction;
@@ -57,24 +59,38 @@ public:
     uint maxBatchSize;
     uint batchSize;
     bool uniqueDatabaseIds;
-    uint lastBatchStarted;
+    EString error;
 
     class Decoder
         : public EventHandler
     {
     public:
         Decoder( FetcherData * fd )
-            : q( 0 ), d( fd ) {
+            : q( 0 ), d( fd ), type( Fetcher::Trivia ),
+              ids( 0 ), bytes( 0 ) {
             setLog( new Log );
         }
         void execute();
         void process();
+        void process( List<Message> * );
+        void land();
+        void record();
         virtual void decode( Message *, List<Row> * ) = 0;
         virtual void setDone( Message * ) = 0;
         virtual bool isDone( Message * ) const = 0;
         Query * q;
         FetcherData * d;
         List<Row> mr;
+
+        Fetcher::Type type;
+        IntegerSet flying;
+        Map< List<Message> > riders;
+        List<Fetcher> waiters;
+        EString error;
+
+        uint ids;
+        uint bytes;
+        struct timeval started;
     };
 
     Decoder * addresses;
@@ -135,9 +151,44 @@ public:
     };
 
     Connection * throttler;
+
+    Decoder * decoder( Fetcher::Type );
+
+    static void fail( Fetcher * f, const EString & e ) {
+        if ( f->d->error.isEmpty() )
+            f->d->error = e;
+    }
 };
 
 
+static Map<FetcherData::Decoder> * flights[Fetcher::Trivia+1];
+
+static uint usecPerMessage[Fetcher::Trivia+1];
+static uint bytesPerMessage[Fetcher::Trivia+1];
+static GraphableNumber * latencies[Fetcher::Trivia+1];
+static GraphableNumber * batchSizes = 0;
+
+
+/*! Returns the decoder used for \a t, or a null pointer if none is. */
+
+FetcherData::Decoder * FetcherData::decoder( Fetcher::Type t )
+{
+    switch ( t ) {
+    case Fetcher::Addresses:
+        return addresses;
+    case Fetcher::OtherHeader:
+        return otherheader;
+    case Fetcher::Body:
+        return body;
+    case Fetcher::PartNumbers:
+        return partnumbers;
+    case Fetcher::Trivia:
+        return trivia;
+    }
+    return 0;
+}
+
+
 /*! \class Fetcher fetcher.h
 
     The Fetcher class retrieves Message data for some/all messages in
@@ -151,6 +202,13 @@ public:
     an SQL select for them. Typically the select ends with
     "mailbox=$71 and uid in any($72). When the Fetcher isn't useful
     any more, its owner drops it on the floor.
+
+    Fetchers which don't use a Transaction cooperate: If one Fetcher
+    needs data that another is already selecting, it doesn't issue
+    its own select, but waits for the other's, which decodes the rows
+    into both Fetchers' messages. This helps when many clients look
+    at the same new message at once, e.g. just after delivery to a
+    shared mailbox.
 */
 
 
@@ -293,7 +351,8 @@ void Fetcher::start()
          what.join( " " ) );
 
     // we'll use two steps. first, we find a good size for the first
-    // batch.
+    // batch. prepareBatch() overrides this if earlier Fetchers have
+    // told us what these types cost.
     d->batchSize = 4096;
     if ( d->body )
         d->batchSize = d->batchSize / 2;
@@ -336,6 +395,21 @@ void Fetcher::waitForEnd()
         ++i;
     }
 
+    List<Query>::Iterator a( d->awaited );
+    while ( a ) {
+        if ( !a->done() )
+            return;
+        ++a;
+    }
+    d->awaited.clear();
+
+    if ( !d->error.isEmpty() ) {
+        // don't mark anything as fetched, so nobody uses what we
+        // didn't manage to fetch.
+        d->messages.clear();
+        d->batch.clear();
+    }
+
     Map< List<Message> >::Iterator bi( d->batch );
     while ( bi ) {
         List<Message>::Iterator li( *bi );
@@ -376,69 +450,81 @@ void Fetcher::waitForEnd()
 
 
 /*! Messages are fetched in batches, so that we can deliver some rows
-    early on. This function adjusts the size of the batches so we'll
-    get about one batch every 6 seconds, and updates the tables so we
-    have a batch ready for reading.
+    early on. This function picks the size of the next batch and
+    updates the tables so we have a batch ready for reading.
+
+    The size is based on what earlier batches of the same types cost,
+    per message, in time and in bytes: It's the largest size that
+    should stay within both fetch-batch-time and fetch-batch-memory.
+    The decoders of a batch hold their rows at the same time, so
+    fetch-batch-memory is shared among them. Until we know anything
+    about costs, the size chosen by start() is used.
 */
 
 
 void Fetcher::prepareBatch()
 {
-    uint now = (uint)time( 0 );
-    if ( d->lastBatchStarted ) {
-        uint prevBatchSize = d->batchSize;
-        if ( now == d->lastBatchStarted ) {
-            // if we took zero time, let's do a small batch size
-            // increase, because that's suspiciously fast.
-            d->batchSize = d->batchSize * 2;
-        }
-        else if ( now < d->lastBatchStarted ) {
-            // if time went backwards we're very, very careful.
-            d->batchSize = 128;
-        }
-        else {
-            // we adjust the batch size so the next batch could take
-            // something in the approximate region of 6 seconds.
-            uint diff = now - d->lastBatchStarted;
-            d->batchSize = d->batchSize * 6 / diff;
+    uint prevBatchSize = d->batchSize;
+
+    int64 duration = 1000 * (int64)
+                 Configuration::scalar( Configuration::FetchBatchTime );
+    int64 memory = 1024 * 1024 * (int64)
+                   Configuration::scalar( Configuration::FetchBatchMemory );
+    int64 size = d->maxBatchSize;
+    int64 bytes = 0;
+    bool known = false;
+    uint t = 0;
+    while ( t <= Trivia ) {
+        if ( d->decoder( (Type)t ) ) {
+            if ( usecPerMessage[t] && duration / usecPerMessage[t] < size )
+                size = duration / usecPerMessage[t];
+            bytes += bytesPerMessage[t];
+            if ( usecPerMessage[t] || bytesPerMessage[t] )
+                known = true;
         }
-
-        // the batch size can't increase too much
-        if ( d->batchSize > prevBatchSize * 3 )
-            d->batchSize = prevBatchSize * 3;
-        if ( d->batchSize > prevBatchSize + 2000 )
-            d->batchSize = prevBatchSize + 2000;
-
-        // and we generally don't want it to be too large or small
-        if ( d->batchSize < 128 )
-            d->batchSize = 128;
-        if ( d->batchSize > d->maxBatchSize )
-            d->batchSize = d->maxBatchSize;
-
-        // if we're memory-constrained, then we adjust the batch size
-        // to the amount of RAM we'll probably use. the amount of RAM
-        // we use per message is higher if we'll issue all queries in
-        // sequence, lower if we issue them in parallel. both 40k and
-        // 80k are dreadful estimates, some messages are many-megabyte
-        // monsters, others just 4k.
-        uint limit = 1024 * 1024 *
-                     Configuration::scalar( Configuration::MemoryLimit );
-        uint already = Allocator::inUse() + Allocator::allocated();
-        uint perMessage = 40 * 1024;
-        if ( d->transaction || Database::numHandles() < 2 )
-            perMessage = 80 * 1024;
-        uint batchSizeLimit = ( limit - already ) / perMessage;
-        if ( batchSizeLimit < 32 )
-            batchSizeLimit = 32; // just sanity, shouldn't actually hit
-        if ( d->batchSize > batchSizeLimit )
-            d->batchSize = batchSizeLimit;
-
-        if ( prevBatchSize != d->batchSize )
-            log( "Batch time was " + fn ( now - d->lastBatchStarted ) +
-                 " for " + fn( prevBatchSize ) + " messages, adjusting to " +
-                 fn( d->batchSize ), Log::Debug );
-    }
-    d->lastBatchStarted = now;
+        t++;
+    }
+    if ( bytes && memory / bytes < size )
+        size = memory / bytes;
+    if ( known )
+        d->batchSize = (uint)size;
+
+    // we generally don't want it to be too large or small, but if we
+    // know what messages cost, the limits above win.
+    if ( d->batchSize < 1 )
+        d->batchSize = 1;
+    if ( !known && d->batchSize < 128 )
+        d->batchSize = 128;
+    if ( d->batchSize > d->maxBatchSize )
+        d->batchSize = d->maxBatchSize;
+
+    // if we're memory-constrained, then we adjust the batch size
+    // to the amount of RAM we'll probably use. the amount of RAM
+    // we use per message is higher if we'll issue all queries in
+    // sequence, lower if we issue them in parallel. both 40k and
+    // 80k are dreadful estimates, some messages are many-megabyte
+    // monsters, others just 4k.
+    uint limit = 1024 * 1024 *
+                 Configuration::scalar( Configuration::MemoryLimit );
+    uint already = Allocator::inUse() + Allocator::allocated();
+    uint perMessage = 40 * 1024;
+    if ( d->transaction || Database::numHandles() < 2 )
+        perMessage = 80 * 1024;
+    uint batchSizeLimit = 32;
+    if ( limit > already )
+        batchSizeLimit = ( limit - already ) / perMessage;
+    if ( batchSizeLimit < 32 )
+        batchSizeLimit = 32; // just sanity, shouldn't actually hit
+    if ( d->batchSize > batchSizeLimit )
+        d->batchSize = batchSizeLimit;
+
+    if ( prevBatchSize != d->batchSize )
+        log( "Adjusting batch size from " + fn( prevBatchSize ) +
+             " to " + fn( d->batchSize ) + " messages", Log::Debug );
+
+    if ( !batchSizes )
+        batchSizes = new GraphableNumber( "fetch-batch-size" );
+    batchSizes->setValue( d->batchSize );
 
     // Find out which messages we're going to fetch, and fill in the
     // batch array so we can tie responses to the Message objects.
@@ -462,10 +548,26 @@ void Fetcher::prepareBatch()
 
 /*! Finds out which messages need information of \a type, and binds a
     list of their database IDs to parameter \a n of \a query.
+
+    Messages whose information another Fetcher is already selecting
+    are left out, provided that Fetcher's query hasn't returned any
+    rows yet; instead they're handed to that Fetcher's decoder, and
+    this Fetcher waits for its query.
 */
 
 void Fetcher::bindIds( Query * query, uint n, Type type )
 {
+    FetcherData::Decoder * own = d->decoder( type );
+    own->type = type;
+    Map<FetcherData::Decoder> * f = 0;
+    if ( !d->transaction ) {
+        if ( !flights[type] ) {
+            flights[type] = new Map<FetcherData::Decoder>;
+            Allocator::addEternal( flights[type], "fetches in progress" );
+        }
+        f = flights[type];
+    }
+
     IntegerSet l;
     Map< List<Message> >::Iterator bi( d->batch );
     while ( bi ) {
@@ -497,11 +599,45 @@ void Fetcher::bindIds( Query * query, uint n, Type type )
                     need = false;
                 break;
             }
-            if ( need && m->databaseId() )
+            if ( !need || !m->databaseId() )
+                continue;
+            FetcherData::Decoder * other = 0;
+            if ( f )
+                other = f->find( m->databaseId() );
+            // the decoder handles rows as they arrive, so it's too
+            // late to ride along once the first has arrived.
+            if ( other && other != own && other->q &&
+                 !other->q->done() && !other->q->rows() ) {
+                List<Message> * r = other->riders.find( m->databaseId() );
+                if ( !r ) {
+                    r = new List<Message>;
+                    other->riders.insert( m->databaseId(), r );
+                }
+                r->append( m );
+                if ( !other->waiters.find( this ) )
+                    other->waiters.append( this );
+                if ( !d->awaited.find( other->q ) )
+                    d->awaited.append( other->q );
+            }
+            else {
                 l.add( m->databaseId() );
+            }
         }
     }
     query->bind( n, l );
+
+    own->ids = l.count();
+    own->bytes = 0;
+    (void)::gettimeofday( &own->started, 0 );
+
+    if ( !f )
+        return;
+    own->flying.add( l );
+    uint i = 1;
+    while ( i <= l.count() ) {
+        f->insert( l.value( i ), own );
+        i++;
+    }
 }
 
 
@@ -568,6 +704,7 @@ void Fetcher::makeQueries()
 
     if ( d->body ) {
         q = new Query( "select pn.message, pn.part, bp.text, bp.data, "
+                       "bp.blob, bp.compressed, bp.hash, "
                        "bp.bytes as rawbytes, pn.bytes, pn.lines "
                        "from part_numbers pn "
                        "left join bodyparts bp on (pn.bodypart=bp.id) "
@@ -592,6 +729,7 @@ void FetcherData::Decoder::execute()
         mid = mr.firstElement()->getInt( "message" );
     while ( q->hasResults() ) {
         Row * r = q->nextRow();
+        bytes += r->size();
         int id = r->getInt( "message" );
         if ( mid != id ) {
             process();
@@ -602,27 +740,123 @@ void FetcherData::Decoder::execute()
     if ( !q->done() )
         return;
     process();
+    record();
+    if ( !error.isEmpty() )
+        FetcherData::fail( d->f, error );
+    land();
     d->f->execute();
 }
 
+
+/*! Records how long this decoder's query took and how much data it
+    returned, per message, so prepareBatch() can size later batches.
+*/
+
+void FetcherData::Decoder::record()
+{
+    if ( !ids )
+        return;
+
+    struct timeval now;
+    (void)::gettimeofday( &now, 0 );
+    int64 usec = ( now.tv_sec - started.tv_sec ) * (int64)1000000 +
+                 now.tv_usec - started.tv_usec;
+    if ( usec < 0 )
+        usec = 0;
+
+    uint u = (uint)( usec / ids ) + 1;
+    uint b = bytes / ids + 1;
+    if ( usecPerMessage[type] )
+        u = ( usecPerMessage[type] * 3 + u ) / 4;
+    if ( bytesPerMessage[type] )
+        b = ( bytesPerMessage[type] * 3 + b ) / 4;
+    usecPerMessage[type] = u;
+    bytesPerMessage[type] = b;
+
+    if ( !latencies[type] ) {
+        EString n;
+        switch ( type ) {
+        case Fetcher::Addresses:
+            n = "addresses";
+            break;
+        case Fetcher::OtherHeader:
+            n = "otherheader";
+            break;
+        case Fetcher::Body:
+            n = "body";
+            break;
+        case Fetcher::PartNumbers:
+            n = "partnumbers";
+            break;
+        case Fetcher::Trivia:
+            n = "trivia";
+            break;
+        }
+        latencies[type] = new GraphableNumber( "fetch-latency-" + n );
+    }
+    latencies[type]->setValue( (uint)( usec / 1000 ) );
+    ids = 0;
+}
+
+
+/*! Forgets the messages this decoder was fetching on behalf of other
+    Fetchers, and tells those Fetchers that the query is done.
+*/
+
+void FetcherData::Decoder::land()
+{
+    if ( flights[type] ) {
+        uint i = 1;
+        while ( i <= flying.count() ) {
+            uint id = flying.value( i );
+            if ( flights[type]->find( id ) == this )
+                flights[type]->remove( id );
+            i++;
+        }
+    }
+    flying.clear();
+    riders.clear();
+
+    // the riders can't be told apart, so if anything failed, all of
+    // the waiting Fetchers fail.
+    List<Fetcher>::Iterator w( waiters );
+    while ( w ) {
+        Fetcher * f = w;
+        ++w;
+        if ( !error.isEmpty() )
+            FetcherData::fail( f, error );
+        f->notify();
+    }
+    waiters.clear();
+    error.truncate();
+}
+
 void FetcherData::Decoder::process()
 {
     if ( mr.isEmpty() )
         return;
     uint id = mr.firstElement()->getInt( "message" );
-    List<Message> * l = d->batch.find( id );
-    if ( !l )
-        return;
+    process( d->batch.find( id ) );
+    process( riders.find( id ) );
+    mr.clear();
+}
+
+
+/*! Decodes the current rows into each message in \a l that still
+    needs them. */
+
+void FetcherData::Decoder::process( List<Message> * l )
+{
     List<Message>::Iterator i( l );
     while ( i ) {
         Message * m = i;
         ++i;
         if ( m && !isDone( m ) ) {
             decode( m, &mr );
-            setDone( m );
+            if ( error.isEmpty() )
+                setDone( m );
         }
     }
-    mr.clear();
 }
 
 void FetcherData::HeaderDecoder::decode( Message * m, List<Row> * rows )
@@ -750,7 +984,31 @@ void FetcherData::BodyDecoder::decode( Message * m, List<Row> * rows )
         if ( !part.endsWith( ".rfc822" ) ) {
             Bodypart * bp = m->bodypart( part, true );
 
-            if ( !r->isNull( "data" ) )
+            if ( !r->isNull( "blob" ) && r->getBoolean( "blob" ) ) {
+                EString blob;
+                if ( BlobStore::contents( r->getEString( "hash" ), &blob ) ) {
+                    bp->setData( blob );
+                }
+                else if ( error.isEmpty() ) {
+                    error = "Could not read bodypart " + part +
+                            " of message " + fn( m->databaseId() ) +
+                            " from the blob store";
+                    log( error, Log::Error );
+                }
+            }
+            else if ( !r->isNull( "data" ) && r->getBoolean( "compressed" ) ) {
+                bool ok = false;
+                EString data = r->getEString( "data" ).uncompressed( &ok );
+                if ( ok ) {
+                    bp->setData( data );
+                }
+                else if ( error.isEmpty() ) {
+                    error = "Could not uncompress bodypart " + part +
+                            " of message " + fn( m->databaseId() );
+                    log( error, Log::Error );
+                }
+            }
+            else if ( !r->isNull( "data" ) )
                 bp->setData( r->getEString( "data" ) );
             else if ( !r->isNull( "text" ) )
                 bp->setText( r->getUString( "text" ) );
@@ -904,6 +1162,27 @@ bool Fetcher::fetching( Type t ) const
 }
 
 
+/*! Returns true if this Fetcher couldn't fetch everything it was
+    asked to, and false if it's working or succeeded. If it failed,
+    none of its messages are marked as fetched, and error() says why.
+*/
+
+bool Fetcher::failed() const
+{
+    return !d->error.isEmpty();
+}
+
+
+/*! Returns a description of the first error this Fetcher met, or an
+    empty string if it hasn't failed().
+*/
+
+EString Fetcher::error() const
+{
+    return d->error;
+}
+
+
 /*! Records that all queries done by this Fetcher should be performed
     within \a t. This can be useful e.g. if some messages may be
     locked by \a t, or if the retrieval is tied to \a t logically.
@@ -5,6 +5,7 @@
 
 #include "event.h"
 #include "list.h"
+#include "estring.h"
 
 
 class Row;
@@ -41,11 +42,14 @@ public:
     void execute();
 
     bool done() const;
+    bool failed() const;
+    EString error() const;
 
     void setTransaction( class Transaction * );
 
 private:
     class FetcherData * d;
+    friend class FetcherData;
 
 private:
     void start();
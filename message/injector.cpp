@@ -12,9 +12,11 @@
 #include "ustring.h"
 #include "mailbox.h"
 #include "bodypart.h"
+#include "blobstore.h"
 #include "datefield.h"
 #include "mimefields.h"
 #include "messagecache.h"
+#include "configuration.h"
 #include "helperrowcreator.h"
 #include "addressfield.h"
 #include "transaction.h"
@@ -38,7 +40,8 @@ struct BodypartRow
     : public Garbage
 {
     BodypartRow()
-        : id( 0 ), text( 0 ), data( 0 ), bytes( 0 )
+        : id( 0 ), text( 0 ), data( 0 ), bytes( 0 ),
+          blob( false ), compressed( false )
     {}
 
     uint id;
@@ -46,6 +49,8 @@ struct BodypartRow
     EString * text;
     EString * data;
     uint bytes;
+    bool blob;
+    bool compressed;
     List<Bodypart> bodyparts;
 };
 
@@ -1148,10 +1153,11 @@ void Injector::insertBodyparts()
                 new Query( "create temporary table bp ("
                            "bid integer, bytes integer, "
                            "hash text, text text, data bytea, "
+                           "blob boolean, compressed boolean, "
                            "i integer, n boolean default 'f')", 0 );
 
             Query * copy =
-                new Query( "copy bp (bytes,hash,text,data,i) "
+                new Query( "copy bp (bytes,hash,text,data,blob,compressed,i) "
                            "from stdin with binary", this );
 
             uint i = 0;
@@ -1169,7 +1175,9 @@ void Injector::insertBodyparts()
                     copy->bind( 4, *br->data );
                 else
                     copy->bindNull( 4 );
-                copy->bind( 5, i++ );
+                copy->bind( 5, br->blob );
+                copy->bind( 6, br->compressed );
+                copy->bind( 7, i++ );
                 copy->submitLine();
 
                 ++bi;
@@ -1186,7 +1194,8 @@ void Injector::insertBodyparts()
             Query * setId =
                 new Query( "update bp set bid=b.id from bodyparts b where "
                            "bp.hash=b.hash and not bp.text is distinct from "
-                           "b.text and not bp.data is distinct from b.data",
+                           "b.text and not bp.data is distinct from b.data "
+                           "and bp.blob=b.blob and bp.compressed=b.compressed",
                            0 );
 
             Query * setNew =
@@ -1195,8 +1204,8 @@ void Injector::insertBodyparts()
 
             d->insert =
                 new Query( "insert into bodyparts "
-                           "(id,bytes,hash,text,data) "
-                           "select bid,bytes,hash,text,data "
+                           "(id,bytes,hash,text,data,blob,compressed) "
+                           "select bid,bytes,hash,text,data,blob,compressed "
                            "from bp where n", this );
 
             d->substate++;
@@ -1341,6 +1350,24 @@ void Injector::addBodypartRow( Bodypart * b )
         br->text = text;
         br->data = data;
         br->bytes = b->numBytes();
+        // Large binary bodyparts go to the blob directory if there is
+        // one, and if writing the file fails, to the database.
+        if ( data && !text && BlobStore::suitable( data->length() ) &&
+             BlobStore::store( hash, *data ) ) {
+            br->data = 0;
+            br->blob = true;
+        }
+        // The rest may be compressed, if that saves a worthwhile
+        // amount of space. Text isn't, since we search it.
+        if ( br->data && br->data->length() > 256 &&
+             Configuration::toggle( Configuration::CompressBodyparts ) ) {
+            EString * c = new EString( br->data->compressed() );
+            if ( !c->isEmpty() &&
+                 c->length() < br->data->length() - br->data->length() / 8 ) {
+                br->data = c;
+                br->compressed = true;
+            }
+        }
         d->hashes.insert( hash, br );
         d->bodyparts.append( br );
     }
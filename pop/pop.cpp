@@ -137,6 +137,16 @@ void POP::setState( State s )
 
                 if ( !t ) {
                     t = new ::Transaction( this );
+                    // lock the messages before the mailbox, as
+                    // Store does.
+                    Query * l = new Query( "select uid "
+                                           "from mailbox_messages "
+                                           "where mailbox=$1 "
+                                           "and uid=any($2) "
+                                           "order by uid for update", 0 );
+                    l->bind( 1, mailbox->id() );
+                    l->bind( 2, s );
+                    t->enqueue( l );
                     nms = new Query( "select nextmodseq from mailboxes "
                                      "where id=$1 for update", this );
                     nms->bind( 1, mailbox->id() );
@@ -418,8 +428,10 @@ void POP::runCommands()
         return;
     if ( it->done() )
         d->commands->take( it );
-    if ( it )
+    if ( it ) {
+        Scope x( it->log() );
         it->execute();
+    }
 }
 
 
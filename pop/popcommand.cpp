@@ -8,6 +8,7 @@
 #include "list.h"
 #include "user.h"
 #include "plain.h"
+#include "span.h"
 #include "query.h"
 #include "buffer.h"
 #include "fetcher.h"
@@ -19,6 +20,8 @@
 #include "permissions.h"
 #include "messagecache.h"
 
+#include <string.h> // memchr
+
 
 class PopCommandData
     : public Garbage
@@ -29,7 +32,8 @@ public:
           m( 0 ), r( 0 ),
           user( 0 ), mailbox( 0 ), permissions( 0 ),
           session( 0 ), sentFetch( false ), started( false ),
-          message( 0 ), n( 0 ), findIds( 0 ), map( 0 )
+          message( 0 ), fetcher( 0 ), n( 0 ),
+          findIds( 0 ), map( 0 ), span( 0 )
     {}
 
     POP * pop;
@@ -48,11 +52,14 @@ public:
     bool sentFetch;
     bool started;
     Message * message;
+    Fetcher * fetcher;
     int n;
 
     Query * findIds;
     Map<Message> * map;
 
+    Span * span;
+
     class PopSession
         : public Session
     {
@@ -75,6 +82,13 @@ public:
 */
 
 
+static const char * commandNames[] = {
+    "QUIT", "CAPA", "NOOP", "STLS", "AUTH", "USER", "PASS", "APOP",
+    "STAT", "LIST", "RETR", "DELE", "RSET", "TOP", "UIDL",
+    "SESSION"
+};
+
+
 /*! Creates a new PopCommand object representing the command \a cmd, for
     the POP server \a pop, with the arguments in \a args.
 */
@@ -85,6 +99,9 @@ PopCommand::PopCommand( POP * pop, Command cmd, EStringList * args )
     d->pop = pop;
     d->cmd = cmd;
     d->args = args;
+    setLog( new Log );
+    d->span = new Span( log(), EString( "POP " ) + commandNames[cmd] );
+    d->span->enter( "queue" );
 }
 
 
@@ -96,6 +113,7 @@ PopCommand::PopCommand( POP * pop, Command cmd, EStringList * args )
 void PopCommand::finish()
 {
     d->done = true;
+    d->span->finish();
     d->pop->runCommands();
 }
 
@@ -126,6 +144,8 @@ void PopCommand::execute()
     if ( d->done )
         return;
 
+    d->span->enter( "execute" );
+
     switch ( d->cmd ) {
     case Quit:
         log( "Closing connection due to QUIT command", Log::Debug );
@@ -608,8 +628,50 @@ bool PopCommand::list()
 }
 
 
+/*! Appends \a s to \a b, dot-stuffing each line that starts with a
+    dot, and returns the number of lines appended. If \a max is
+    nonnegative, at most \a max lines are appended. \a s is expected
+    to use CRLF; if its last line isn't terminated, a CRLF is added.
+
+    Runs of lines are appended as single chunks, and memchr() finds
+    the line ends, so this is cheap even for large messages.
+*/
+
+static uint appendDotStuffed( Buffer * b, const EString & s, int max )
+{
+    const char * p = s.data();
+    const char * e = p + s.length();
+    const char * chunk = p;
+    uint n = 0;
+    while ( p < e && ( max < 0 || n < (uint)max ) ) {
+        if ( *p == '.' ) {
+            b->append( chunk, p - chunk );
+            b->append( ".", 1 );
+            chunk = p;
+        }
+        const char * nl = (const char *)memchr( p, '\n', e - p );
+        n++;
+        if ( !nl ) {
+            b->append( chunk, e - chunk );
+            b->append( "\r\n", 2 );
+            chunk = e;
+            p = e;
+        }
+        else {
+            p = nl + 1;
+        }
+    }
+    if ( p > chunk )
+        b->append( chunk, p - chunk );
+    return n;
+}
+
+
 /*! Handles both the RETR (if \a lines is false) and TOP (if \a lines
     is true) commands.
+
+    The header and body are appended directly to the write buffer,
+    without splitting them into lines first.
 */
 
 bool PopCommand::retr( bool lines )
@@ -650,7 +712,9 @@ bool PopCommand::retr( bool lines )
 
         d->started = true;
         Fetcher * f = new Fetcher( d->message, this );
-        if ( !d->message->hasBodies() )
+        d->fetcher = f;
+        // TOP 0 needs only the header, so we don't fetch the body.
+        if ( !d->message->hasBodies() && !( lines && d->n == 0 ) )
             f->fetch( Fetcher::Body );
         if ( !d->message->hasHeaders() )
             f->fetch( Fetcher::OtherHeader );
@@ -659,10 +723,16 @@ bool PopCommand::retr( bool lines )
         f->execute();
     }
 
-    if ( !( d->message->hasBodies() &&
-            d->message->hasHeaders() &&
+    if ( d->fetcher && d->fetcher->failed() ) {
+        d->pop->err( "Could not read message" );
+        return true;
+    }
+
+    if ( !( d->message->hasHeaders() &&
             d->message->hasAddresses() ) )
         return false;
+    if ( !d->message->hasBodies() && !( lines && d->n == 0 ) )
+        return false;
 
     if ( d->message->rfc822Size() > 2 )
         d->pop->ok( "Done" );
@@ -672,42 +742,18 @@ bool PopCommand::retr( bool lines )
         return true;
     }
 
-    Buffer * b = new Buffer;
-    b->append( d->message->rfc822( true ) ); // XXX always downgrades
-
-    int ln = d->n;
-    bool header = true;
-    int lnhead = 0;
-    int lnbody = 0;
-    int msize = b->size();
-
-    EString * t;
-    while ( ( t = b->removeLine() ) != 0 ) {
-        if ( header && t->isEmpty() )
-            header = false;
-
-        if ( !header && lines && ln-- < 0 )
-            break;
-
-        if ( header )
-            lnhead++;
-        else
-            lnbody++;
-
-        if ( t->startsWith( "." ) )
-            d->pop->enqueue( "." );
-        d->pop->enqueue( *t );
-        d->pop->enqueue( "\r\n" );
-    }
-
-    EString st = b->string( b->size() );
-    if ( !st.isEmpty() && !( !header && lines && ln-- < 0 ) ) {
-        if ( st.startsWith( "." ) )
-            d->pop->enqueue( "." );
-        d->pop->enqueue( st );
-        d->pop->enqueue( "\r\n" );
+    // XXX always downgrades
+    Buffer * b = d->pop->writeBuffer();
+    EString h = d->message->header()->asText( true );
+    uint msize = h.length() + 2;
+    uint lnhead = appendDotStuffed( b, h, -1 );
+    b->append( "\r\n", 2 );
+    uint lnbody = 0;
+    if ( !lines || d->n > 0 ) {
+        EString body = d->message->body( true );
+        msize += body.length();
+        lnbody = appendDotStuffed( b, body, lines ? d->n : -1 );
     }
-
     d->pop->enqueue( ".\r\n" );
 
     if( !lines )
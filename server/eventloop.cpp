@@ -186,6 +186,8 @@ List< Connection > *EventLoop::connections() const
 
 
 static GraphableNumber * sizeinram = 0;
+static GraphableNumber * buffered = 0;
+static GraphableHistogram * gcPauses = 0;
 
 static const uint gcDelay = 30;
 
@@ -219,11 +221,15 @@ void EventLoop::start()
 
         // Figure out what events each connection wants.
 
+        uint unwritten = 0;
         List< Connection >::Iterator it( d->connections );
         while ( it ) {
             c = it;
             ++it;
 
+            if ( c->writeBuffer() )
+                unwritten += c->writeBuffer()->size();
+
             int fd = c->fd();
             if ( fd < 0 ) {
                 removeConnection( c );
@@ -281,6 +287,9 @@ void EventLoop::start()
         if ( !sizeinram )
             sizeinram = new GraphableNumber( "memory-used" );
         sizeinram->setValue( Allocator::inUse() + Allocator::allocated() );
+        if ( !buffered )
+            buffered = new GraphableNumber( "write-buffer-size" );
+        buffered->setValue( unwritten );
 
         // Any interesting timers?
 
@@ -392,7 +401,14 @@ void EventLoop::freeMemory()
             x.append( c );
         ++i;
     }
+    struct timeval before, after;
+    (void)::gettimeofday( &before, 0 );
     Garbage * biggest = Allocator::free( &x );
+    (void)::gettimeofday( &after, 0 );
+    if ( !gcPauses )
+        gcPauses = new GraphableHistogram( "gc-pause-milliseconds" );
+    gcPauses->addValue( ( after.tv_sec - before.tv_sec ) * 1000 +
+                        ( after.tv_usec - before.tv_usec ) / 1000 );
     // x now points to free memory
     i = d->connections.first();
     Connection * victim = 0;
@@ -4,12 +4,17 @@
 
 #include "allocator.h"
 #include "eventloop.h"
+#include "estringlist.h"
+#include "buffer.h"
+#include "dict.h"
 #include "list.h"
 
 #include <time.h> // time()
 
 
 static List<GraphableNumber> * numbers = 0;
+static List<GraphableHistogram> * histograms = 0;
+static Dict<GraphableHistogram> * histogramsByName = 0;
 
 
 static const uint graphableHistorySize = 960; // 15 minutes and a little bit
@@ -19,7 +24,7 @@ class GraphableNumberData
     : public Garbage
 {
 public:
-    GraphableNumberData(): min( 0 ), max( 0 ) {
+    GraphableNumberData(): min( 0 ), max( 0 ), counter( false ) {
         uint i = 0;
         while ( i < graphableHistorySize )
             values[i++] = 0;
@@ -29,6 +34,7 @@ public:
     // no pointers after this line
     uint min;
     uint max;
+    bool counter;
     uint values[::graphableHistorySize];
 };
 
@@ -193,6 +199,26 @@ EString GraphableNumber::name() const
 }
 
 
+/*! Returns true if this number only ever increases (ie. it's a
+    GraphableCounter), and false if it's a gauge.
+*/
+
+bool GraphableNumber::isCounter() const
+{
+    return d->counter;
+}
+
+
+/*! Records that this number is a counter if \a c is true, and a
+    gauge if not. The default is false.
+*/
+
+void GraphableNumber::setCounter( bool c )
+{
+    d->counter = c;
+}
+
+
 /*! \class GraphableCounter graph.h
 
     The GraphableCounter class provides a tick counter; you can tell
@@ -205,6 +231,7 @@ EString GraphableNumber::name() const
 GraphableCounter::GraphableCounter( const EString & name )
     : GraphableNumber( name )
 {
+    setCounter( true );
     setValue( 0 );
 }
 
@@ -221,7 +248,7 @@ class GraphableDataSetData
     : public Garbage
 {
 public:
-    GraphableDataSetData(): t( 0 ), n( 0 ) {}
+    GraphableDataSetData(): t( 0 ), s( 0 ), n( 0 ) {}
     uint t;
     uint s;
     uint n;
@@ -241,7 +268,7 @@ public:
 /*! Constructs an empty data set named \a name. */
 
 GraphableDataSet::GraphableDataSet( const EString & name )
-    : GraphableNumber( name )
+    : GraphableNumber( name ), d( new GraphableDataSetData )
 {
 }
 
@@ -256,10 +283,162 @@ void GraphableDataSet::addNumber( uint n )
         d->n = 0;
         d->s = 0;
     }
-    n++;
+    d->n++;
     d->s += n;
-    if ( d->n )
-        setValue( ( d->s + (d->n/2) ) / d->n );
+    setValue( ( d->s + (d->n/2) ) / d->n );
+}
+
+
+static const uint bucketLimits[] = {
+    1, 2, 5, 10, 20, 50, 100, 200, 500,
+    1000, 2000, 5000, 10000, 30000, 60000
+};
+static const uint numBuckets = sizeof( bucketLimits ) / sizeof( uint );
+
+
+class GraphableHistogramData
+    : public Garbage
+{
+public:
+    GraphableHistogramData(): count( 0 ), sum( 0 ) {
+        uint i = 0;
+        while ( i < numBuckets )
+            buckets[i++] = 0;
+        setFirstNonPointer( &count );
+    }
+    EString name;
+    EString labels;
+    // no pointers after this line
+    uint count;
+    int64 sum;
+    uint buckets[numBuckets];
+};
+
+
+/*! \class GraphableHistogram graph.h
+
+    The GraphableHistogram class counts how many values fall into each
+    of a fixed set of buckets, e.g. how many IMAP commands took less
+    than 1ms, 2ms, 5ms and so on. Unlike GraphableNumber, it keeps no
+    history; it's meant to be sampled by MetricsServer.
+
+    A histogram has a name() and optionally some labels(), which
+    distinguish e.g. one IMAP command from another. find() returns the
+    histogram for a name/labels pair, creating it if necessary.
+
+    Like GraphableNumber, objects of this class are never deleted.
+*/
+
+
+/*! Constructs an empty histogram called \a name with \a labels. The
+    labels should be in the form a="b",c="d". */
+
+GraphableHistogram::GraphableHistogram( const EString & name,
+                                        const EString & labels )
+    : d( new GraphableHistogramData )
+{
+    d->name = name;
+    d->labels = labels;
+    if ( !histograms ) {
+        histograms = new List<GraphableHistogram>;
+        Allocator::addEternal( histograms, "histograms for statistics" );
+        histogramsByName = new Dict<GraphableHistogram>;
+        Allocator::addEternal( histogramsByName, "histograms by name" );
+    }
+    histograms->append( this );
+    histogramsByName->insert( name + "{" + labels + "}", this );
+}
+
+
+/*! Returns the histogram named \a name with \a labels, creating it
+    if necessary. */
+
+GraphableHistogram * GraphableHistogram::find( const EString & name,
+                                               const EString & labels )
+{
+    GraphableHistogram * h = 0;
+    if ( histogramsByName )
+        h = histogramsByName->find( name + "{" + labels + "}" );
+    if ( !h )
+        h = new GraphableHistogram( name, labels );
+    return h;
+}
+
+
+/*! Adds \a v to the histogram. */
+
+void GraphableHistogram::addValue( uint v )
+{
+    uint i = 0;
+    while ( i < numBuckets && v > bucketLimits[i] )
+        i++;
+    if ( i < numBuckets )
+        d->buckets[i]++;
+    d->count++;
+    d->sum += v;
+}
+
+
+/*! Returns the name supplied to the constructor. */
+
+EString GraphableHistogram::name() const
+{
+    return d->name;
+}
+
+
+/*! Returns the labels supplied to the constructor. */
+
+EString GraphableHistogram::labels() const
+{
+    return d->labels;
+}
+
+
+/*! Returns the number of values added so far. */
+
+uint GraphableHistogram::count() const
+{
+    return d->count;
+}
+
+
+/*! Returns the number of values added so far that were at most
+    bucketLimit( \a bucket ). */
+
+uint GraphableHistogram::count( uint bucket ) const
+{
+    uint n = 0;
+    uint i = 0;
+    while ( i <= bucket && i < numBuckets )
+        n += d->buckets[i++];
+    return n;
+}
+
+
+/*! Returns the sum of all values added so far. */
+
+int64 GraphableHistogram::sum() const
+{
+    return d->sum;
+}
+
+
+/*! Returns the number of buckets each histogram has. */
+
+uint GraphableHistogram::buckets()
+{
+    return numBuckets;
+}
+
+
+/*! Returns the upper limit of \a bucket. */
+
+uint GraphableHistogram::bucketLimit( uint bucket )
+{
+    if ( bucket >= numBuckets )
+        return UINT_MAX;
+    return bucketLimits[bucket];
 }
 
 
@@ -315,3 +494,129 @@ void GraphDumper::react( Event )
 {
     setState( Closing );
 }
+
+
+/*! \class MetricsServer graph.h
+    This Connection subclass serves the current statistics over HTTP,
+    in the text format used by Prometheus and OpenMetrics.
+
+    It waits for an HTTP request (any request), answers it with
+    metrics() and closes the connection.
+*/
+
+/*! Constructs a MetricsServer serving the client on \a fd. */
+
+MetricsServer::MetricsServer( int fd )
+    : Connection( fd, Connection::GraphDumper )
+{
+    EventLoop::global()->addConnection( this );
+    setTimeoutAfter( 10 );
+}
+
+
+void MetricsServer::react( Event e )
+{
+    if ( e != Read ) {
+        setState( Closing );
+        return;
+    }
+
+    EString * l = readBuffer()->removeLine();
+    while ( l && !l->isEmpty() )
+        l = readBuffer()->removeLine();
+    if ( !l )
+        return;
+
+    EString body = metrics();
+    enqueue( "HTTP/1.0 200 OK\r\n"
+             "Content-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: " + fn( body.length() ) + "\r\n"
+             "Connection: close\r\n"
+             "\r\n" );
+    enqueue( body );
+    setState( Closing );
+}
+
+
+static EString metricName( const EString & name )
+{
+    EString r( "aox_" );
+    uint i = 0;
+    while ( i < name.length() ) {
+        char c = name[i++];
+        if ( c == '-' )
+            c = '_';
+        r.append( c );
+    }
+    return r;
+}
+
+
+/*! Returns the current value of each GraphableNumber and
+    GraphableHistogram, formatted for Prometheus. */
+
+EString MetricsServer::metrics()
+{
+    EString r;
+    List<GraphableNumber>::Iterator i( numbers );
+    while ( i ) {
+        EString n = metricName( i->name() );
+        r.append( "# TYPE " + n );
+        if ( i->isCounter() )
+            r.append( " counter\n" );
+        else
+            r.append( " gauge\n" );
+        r.append( n + " " + fn( i->lastValue() ) + "\n" );
+        ++i;
+    }
+
+    // all histograms with the same name must be together, so we
+    // find the names first.
+    EStringList names;
+    List<GraphableHistogram>::Iterator h( histograms );
+    while ( h ) {
+        names.append( h->name() );
+        ++h;
+    }
+    names.removeDuplicates();
+
+    EStringList::Iterator name( names );
+    while ( name ) {
+        EString n = metricName( *name );
+        r.append( "# TYPE " + n + " histogram\n" );
+        h = histograms->first();
+        while ( h ) {
+            if ( h->name() == *name )
+                appendHistogram( r, n, h );
+            ++h;
+        }
+        ++name;
+    }
+    return r;
+}
+
+
+/*! Appends the buckets, sum and count of \a h to \a r, using the
+    metric name \a n. */
+
+void MetricsServer::appendHistogram( EString & r, const EString & n,
+                                     GraphableHistogram * h )
+{
+    EString l = h->labels();
+    if ( !l.isEmpty() )
+        l.append( "," );
+    uint b = 0;
+    while ( b < GraphableHistogram::buckets() ) {
+        r.append( n + "_bucket{" + l + "le=\"" +
+                  fn( GraphableHistogram::bucketLimit( b ) ) +
+                  "\"} " + fn( h->count( b ) ) + "\n" );
+        b++;
+    }
+    r.append( n + "_bucket{" + l + "le=\"+Inf\"} " +
+              fn( h->count() ) + "\n" );
+    l = h->labels();
+    if ( !l.isEmpty() )
+        l = "{" + l + "}";
+    r.append( n + "_sum" + l + " " + fn( h->sum() ) + "\n" );
+    r.append( n + "_count" + l + " " + fn( h->count() ) + "\n" );
+}
@@ -24,6 +24,11 @@ public:
     uint youngestTime() const;
     uint value( uint );
 
+    bool isCounter() const;
+
+protected:
+    void setCounter( bool );
+
 private:
     class GraphableNumberData * d;
     void clearOldHistory( uint );
@@ -53,6 +58,30 @@ private:
 };
 
 
+class GraphableHistogram
+    : public Garbage
+{
+public:
+    GraphableHistogram( const EString &, const EString & = "" );
+
+    static GraphableHistogram * find( const EString &, const EString & );
+
+    void addValue( uint );
+
+    EString name() const;
+    EString labels() const;
+    uint count() const;
+    uint count( uint ) const;
+    int64 sum() const;
+
+    static uint buckets();
+    static uint bucketLimit( uint );
+
+private:
+    class GraphableHistogramData * d;
+};
+
+
 class GraphDumper
     : public Connection
 {
@@ -63,4 +92,20 @@ public:
 };
 
 
+class MetricsServer
+    : public Connection
+{
+public:
+    MetricsServer( int );
+
+    void react( Event );
+
+    static EString metrics();
+
+private:
+    static void appendHistogram( EString &, const EString &,
+                                 GraphableHistogram * );
+};
+
+
 #endif
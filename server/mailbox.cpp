@@ -26,6 +26,30 @@ static Map<Mailbox> * mailboxes = 0;
 static UDict<Mailbox> * mailboxesByName = 0;
 static bool wiped = false;
 
+// mailboxes.change is set from a sequence whenever a row is inserted
+// or updated. Every change up to and including lastChange has been
+// read. Each hole covers a range of changes which a reader went
+// through while some were missing; a missing change may yet become
+// visible (when the transaction that made it commits). xmax is the
+// first transaction ID that wasn't running when the range was read,
+// so once the oldest running transaction is at least that new,
+// nothing can fill the holes in the range any more.
+class MailboxHole
+    : public Garbage
+{
+public:
+    MailboxHole( int64 f, int64 l, int64 x )
+        : first( f ), last( l ), xmax( x ) {}
+
+    int64 first;
+    int64 last;
+    int64 xmax;
+};
+
+
+static int64 lastChange = 0;
+static List<MailboxHole> * holes = 0;
+
 
 class MailboxData
     : public Garbage
@@ -70,6 +94,10 @@ public:
     This class maintains a tree of mailboxes, based on the contents of
     the mailboxes table and descriptive messages from the OCServer. It
     can find() a named mailbox in this hierarchy.
+
+    The whole table is read at startup. Afterwards, refreshMailboxes()
+    and the mailboxes_updated notification read only those rows whose
+    change column has advanced since the last read.
 */
 
 
@@ -80,6 +108,12 @@ public:
     EventHandler * owner;
     Query * q;
     bool done;
+    int64 from;
+    int64 seen;
+    int64 expected;
+    int64 gap;
+    int64 xmin;
+    int64 xmax;
 
     MailboxReader( EventHandler * ev, int64 );
     void execute();
@@ -89,8 +123,15 @@ public:
 static List<MailboxReader> * readers = 0;
 
 
+/*! Constructs a reader which reads the mailboxes with change greater
+    than \a c, and notifies \a ev when done. If \a c is 0, all
+    mailboxes are read.
+*/
+
 MailboxReader::MailboxReader( EventHandler * ev, int64 c )
-    : owner( ev ), q( 0 ), done( false )
+    : owner( ev ), q( 0 ), done( false ),
+      from( c ), seen( c ), expected( c + 1 ), gap( 0 ),
+      xmin( 0 ), xmax( 0 )
 {
     if ( !::readers ) {
         ::readers = new List<MailboxReader>;
@@ -98,12 +139,14 @@ MailboxReader::MailboxReader( EventHandler * ev, int64 c )
     }
     ::readers->append( this );
     q = new Query( "select m.id, m.name, m.deleted, m.owner, "
-                   "m.uidnext, m.nextmodseq, m.uidvalidity, m.flag "
-                   //"m.change " // better: m.change
-                   "from mailboxes m ",
-                   //"where change>=$1"
+                   "m.uidnext, m.nextmodseq, m.uidvalidity, m.flag, "
+                   "m.change, "
+                   "txid_snapshot_xmin(txid_current_snapshot()) as xmin, "
+                   "txid_snapshot_xmax(txid_current_snapshot()) as xmax "
+                   "from mailboxes m "
+                   "where m.change>$1 order by m.change",
                    this );
-    c = c; //query->bind( 1, c );
+    q->bind( 1, c );
     if ( !::mailboxes )
         Mailbox::setup();
 }
@@ -113,6 +156,28 @@ void MailboxReader::execute() {
     while ( q->hasResults() ) {
         Row * r = q->nextRow();
 
+        int64 change = r->getBigint( "change" );
+        xmin = r->getBigint( "xmin" );
+        xmax = r->getBigint( "xmax" );
+        // look for the first missing change that may still appear
+        int64 missing = expected;
+        while ( !gap && missing < change ) {
+            MailboxHole * closed = 0;
+            List<MailboxHole>::Iterator i( ::holes );
+            while ( i && !closed ) {
+                if ( i->first <= missing && i->last >= missing &&
+                     xmin >= i->xmax )
+                    closed = i;
+                ++i;
+            }
+            if ( closed )
+                missing = closed->last + 1;
+            else
+                gap = missing;
+        }
+        expected = change + 1;
+        seen = change;
+
         UString n = r->getUString( "name" );
         uint id = r->getInt( "id" );
         Mailbox * m = ::mailboxes->find( id );
@@ -152,6 +217,31 @@ void MailboxReader::execute() {
         q->transaction()->commit();
     ::readers->remove( this );
     ::wiped = false;
+    if ( !q->failed() ) {
+        // A gap in the sequence may be a transaction which hasn't
+        // committed yet, so the next reader starts just before the
+        // first gap. Gaps are skipped once every transaction that
+        // was running when we first saw them has ended (they were
+        // rolled back, or the row was updated again).
+        int64 next = seen;
+        if ( gap ) {
+            next = gap - 1;
+            if ( !::holes ) {
+                ::holes = new List<MailboxHole>;
+                Allocator::addEternal( ::holes, "mailbox change holes" );
+            }
+            ::holes->append( new MailboxHole( gap, seen, xmax ) );
+        }
+        if ( next > ::lastChange )
+            ::lastChange = next;
+        List<MailboxHole>::Iterator i( ::holes );
+        while ( i ) {
+            if ( i->last <= ::lastChange )
+                ::holes->take( i );
+            else
+                ++i;
+        }
+    }
     if ( q->failed() && !EventLoop::global()->inShutdown() ) {
         List<Mailbox> * c = Mailbox::root()->children();
         if ( c && !c->isEmpty() )
@@ -192,7 +282,7 @@ public:
         else {
             // time's out, time to work
             t = 0;
-            m = new MailboxReader( 0, 0 );
+            m = new MailboxReader( 0, ::lastChange );
             m->q->execute();
         }
     }
@@ -217,6 +307,9 @@ public:
             ::mailboxes->clear();
             ::mailboxesByName->clear();
             ::wiped = true;
+            ::lastChange = 0;
+            if ( ::holes )
+                ::holes->clear();
             (void)Mailbox::root();
             mr = new MailboxReader( this, 0 );
             mr->q->execute();
@@ -679,7 +772,7 @@ Query * Mailbox::remove( Transaction * t )
 void Mailbox::refreshMailboxes( class Transaction * t )
 {
     Scope x( new Log );
-    MailboxReader * mr = new MailboxReader( 0, 0 );
+    MailboxReader * mr = new MailboxReader( 0, ::lastChange );
     Transaction * s = t->subTransaction( mr );
     s->enqueue( mr->q );
     s->enqueue( new Query( "notify mailboxes_updated", 0 ) );
@@ -4,9 +4,13 @@
 
 #include "integerset.h"
 #include "estringlist.h"
+#include "dbsignal.h"
 #include "mailbox.h"
+#include "cache.h"
 #include "event.h"
 #include "query.h"
+#include "dict.h"
+#include "map.h"
 #include "user.h"
 
 
@@ -28,12 +32,119 @@ static const char * rightNames[Permissions::NumRights] = {
 };
 
 
+class PermissionsCache
+    : public Cache
+{
+public:
+    // All the ACL entries which apply to one login, by mailbox id.
+    class Entry
+        : public EventHandler
+    {
+    public:
+        Entry( const UString & );
+        void execute();
+
+        UString login;
+        Map<EString> rights;
+        Query * q;
+        List<Permissions> waiting;
+    };
+
+    class Watcher
+        : public EventHandler
+    {
+    public:
+        Watcher( PermissionsCache * pc ): me( pc ) {
+            (void)new DatabaseSignal( "permissions_updated", this );
+        }
+        void execute() {
+            me->clear();
+        }
+        PermissionsCache * me;
+    };
+
+    PermissionsCache(): Cache( 5 ) { (void)new Watcher( this ); }
+    void clear() { logins.clear(); }
+
+    Entry * provide( const UString & );
+
+    UDict<Entry> logins;
+};
+
+static PermissionsCache * cache = 0;
+
+
+/*! Returns the cache entry for \a login, creating it and starting to
+    fetch the ACL entries that apply to \a login if necessary.
+
+    All entries are fetched at once, regardless of mailbox, since
+    there usually are few and most users have none.
+*/
+
+PermissionsCache::Entry * PermissionsCache::provide( const UString & login )
+{
+    Entry * e = logins.find( login );
+    if ( e )
+        return e;
+
+    e = new Entry( login );
+    logins.insert( login, e );
+    e->q = new Query( "select mailbox, rights from permissions "
+                      "where identifier=$1 or"
+                      " identifier='anyone' or"
+                      " identifier in ("
+                      "select g.name from groups g "
+                      "join group_members gm on (g.id=gm.groupid) "
+                      "join users u on (gm.member=u.id) "
+                      "where u.login=$1)",
+                      e );
+    e->q->bind( 1, login );
+    e->q->execute();
+    return e;
+}
+
+
+PermissionsCache::Entry::Entry( const UString & l )
+    : login( l ), q( 0 )
+{
+}
+
+
+void PermissionsCache::Entry::execute()
+{
+    while ( q->hasResults() ) {
+        Row * r = q->nextRow();
+        uint m = r->getInt( "mailbox" );
+        EString * s = rights.find( m );
+        if ( !s ) {
+            s = new EString;
+            rights.insert( m, s );
+        }
+        s->append( r->getEString( "rights" ) );
+    }
+
+    if ( !q->done() )
+        return;
+
+    // A failed lookup is answered as before, but not remembered.
+    if ( q->failed() && ::cache && ::cache->logins.find( login ) == this )
+        ::cache->logins.remove( login );
+
+    List<Permissions>::Iterator i( waiting );
+    while ( i ) {
+        Permissions * p = i;
+        waiting.take( i );
+        p->execute();
+    }
+}
+
+
 class PermissionData
     : public Garbage
 {
 public:
     PermissionData()
-        : ready( false ), mailbox( 0 ), user( 0 ), owner( 0 ), q( 0 )
+        : ready( false ), mailbox( 0 ), user( 0 ), owner( 0 ), entry( 0 )
     {
         uint i = 0;
         while ( i < Permissions::NumRights )
@@ -45,7 +156,7 @@ public:
     User * user;
     EventHandler * owner;
     bool allowed[ Permissions::NumRights ];
-    Query * q;
+    PermissionsCache::Entry * entry;
 };
 
 
@@ -97,6 +208,12 @@ public:
     verify that a user has a given right, and will notify an event
     handler when it's ready() to say whether the access is allowed()
     or not.
+
+    The ACL entries for each user are cached per process, and the
+    cache is cleared when the permissions_updated notification says
+    that the permissions, groups or group_members table has
+    changed. Thus a command which needs the permissions for many
+    mailboxes issues at most one query.
 */
 
 /*! Constructs a Permissions object for \a mailbox and \a authid with
@@ -157,7 +274,7 @@ bool Permissions::allowed( Right r )
 
 void Permissions::execute()
 {
-    if ( !d->q ) {
+    if ( !d->entry ) {
         // The owner of a mailbox always has all rights.
         if ( d->user->login() != "anonymous" &&
              d->user->login() != "anyone" &&
@@ -184,55 +301,39 @@ void Permissions::execute()
         }
 
         // For everyone else, we have to check.
-        d->q = new Query( "select * from permissions "
-                          "where mailbox=any($1) and "
-                          "(identifier=$2 or"
-                          " identifier='anyone' or"
-                          " identifier in ("
-                          "select g.name from groups g "
-                          "join group_members gm on (g.id=gm.groupid) "
-                          "join users u on (gm.member=u.id) "
-                          "where u.login=$2))",
-                          this );
-
-        IntegerSet r;
-        Mailbox * m = d->mailbox;
-        while ( m ) {
-            if ( m->id() && !m->deleted() )
-                r.add( m->id() );
-            m = m->parent();
+        if ( !::cache )
+            ::cache = new PermissionsCache;
+        d->entry = ::cache->provide( d->user->login() );
+        if ( !d->entry->q->done() ) {
+            d->entry->waiting.append( this );
+            return;
         }
-        d->q->bind( 1, r );
-        d->q->bind( 2, d->user->login() );
-        d->q->execute();
+
+        // The answer is known already, so there's no need to notify
+        // the owner.
+        d->owner = 0;
     }
 
-    if ( !d->q->done() )
+    if ( !d->entry->q->done() )
         return;
 
-    EStringList p;
-    Mailbox * candidate = 0;
-
-    while ( d->q->hasResults() ) {
-        Row * r = d->q->nextRow();
-        Mailbox * m = Mailbox::find( r->getInt( "mailbox" ) );
-        EString id = r->getEString( "identifier" );
-        if ( m && ( !candidate ||
-                    candidate->name().length() < m->name().length() ) ) {
-            candidate = m;
-            p.clear();
-        }
-        if ( candidate == m )
-            p.append( r->getEString( "rights" ) );
+    // The closest mailbox with an ACL decides.
+    EString * r = 0;
+    Mailbox * m = d->mailbox;
+    while ( m && !r ) {
+        if ( m->id() && !m->deleted() )
+            r = d->entry->rights.find( m->id() );
+        m = m->parent();
     }
 
-    if ( p.isEmpty() )
+    if ( !r )
         allow( "l" );
     else
-        allow( p.join( "" ) ); // ooooh.
+        allow( *r );
 
     d->ready = true;
-    d->owner->execute();
+    if ( d->owner )
+        d->owner->execute();
 }
 
 
@@ -768,5 +768,10 @@ void Server::maintainChildren()
              " for statistics queries" );
         Configuration::add( "statistics-port = " + fn( port + i - 1 ) );
     }
+    if ( Configuration::toggle( Configuration::UseMetrics ) ) {
+        uint port = Configuration::scalar( Configuration::MetricsPort );
+        log( "Using port " + fn( port + i - 1 ) + " for metrics" );
+        Configuration::add( "metrics-port = " + fn( port + i - 1 ) );
+    }
 }
 
@@ -11,6 +11,7 @@
 #include "event.h"
 #include "query.h"
 #include "scope.h"
+#include "cache.h"
 #include "flag.h"
 #include "map.h"
 #include "log.h"
@@ -39,6 +40,45 @@ public:
 };
 
 
+class PrewarmedSession
+    : public Session
+{
+public:
+    PrewarmedSession( Mailbox * m ): Session( m, true ), loaded( false ) {}
+
+    void emitUpdates( Transaction * );
+
+    bool loaded;
+    List<EventHandler> waiting;
+};
+
+
+void PrewarmedSession::emitUpdates( Transaction * )
+{
+    loaded = true;
+    List<EventHandler>::Iterator i( waiting );
+    while ( i ) {
+        EventHandler * h = i;
+        ++i;
+        h->notify();
+    }
+    waiting.clear();
+}
+
+
+class PrewarmedSessions
+    : public Cache
+{
+public:
+    PrewarmedSessions(): Cache( 2 ) {}
+    void clear() { sessions.clear(); }
+
+    Map<PrewarmedSession> sessions;
+};
+
+static PrewarmedSessions * prewarmed = 0;
+
+
 /*! \class Session session.h
     This class contains all data associated with the single use of a
     Mailbox, such as the number of messages visible, etc. Subclasses
@@ -58,6 +98,8 @@ Session::Session( Mailbox * m, bool readOnly )
     List<Session> * all = d->mailbox->sessions();
     if ( all )
         other = all->firstElement();
+    else if ( ::prewarmed )
+        other = ::prewarmed->sessions.find( m->id() );
     if ( other ) {
         d->uidnext = other->d->uidnext;
         d->nextModSeq = other->d->nextModSeq;
@@ -77,6 +119,53 @@ Session::~Session()
 }
 
 
+/*! Starts loading the state of \a m into a read-only Session that
+    isn't used by any client, so that the next Session on \a m can
+    copy it instead of reading all of \a m's messages from the
+    database. Does nothing if \a m already has sessions, or is being
+    or has recently been prewarmed.
+
+    The state is kept until the next garbage collection or two; a
+    Session created later is brought up to date from the database as
+    usual, starting from the prewarmed state.
+*/
+
+void Session::prewarm( Mailbox * m )
+{
+    if ( !m || !m->id() || m->deleted() || m->sessions() )
+        return;
+    if ( !::prewarmed )
+        ::prewarmed = new PrewarmedSessions;
+    if ( ::prewarmed->sessions.find( m->id() ) )
+        return;
+
+    PrewarmedSession * s = new PrewarmedSession( m );
+    if ( s->initialised() )
+        s->loaded = true;
+    ::prewarmed->sessions.insert( m->id(), s );
+}
+
+
+/*! Returns true if prewarm() is still loading the state of \a m, and
+    if so arranges for \a h to be notified when it's done. Returns
+    false if there is nothing to wait for.
+
+    Select uses this to avoid loading the same state twice.
+*/
+
+bool Session::prewarming( Mailbox * m, EventHandler * h )
+{
+    if ( !::prewarmed || !m || m->sessions() )
+        return false;
+    PrewarmedSession * s = ::prewarmed->sessions.find( m->id() );
+    if ( !s || s->loaded )
+        return false;
+    if ( !s->waiting.find( h ) )
+        s->waiting.append( h );
+    return true;
+}
+
+
 /*! Returns true if this Session has updated itself from the database.
 */
 
@@ -560,10 +649,16 @@ void SessionInitialiser::findMailboxChanges()
     EString msgs = "select mm.uid, mm.modseq from mailbox_messages mm "
                   "where mm.mailbox=$1 and mm.uid<$2";
 
-    // if we know we'll see one new modseq and at least one new
-    // message, we could skip the test on mm.modseq.
+    // new messages are found by uid, changed ones via mailbox_change_log,
+    // so that we don't read every row in a large mailbox.
     if ( !initialising )
-        msgs.append( " and (mm.uid>=$3 or mm.modseq>=$4)" );
+        msgs.append( " and mm.uid>=$3"
+                     " union "
+                     "select mm.uid, mm.modseq from mailbox_messages mm "
+                     "join mailbox_change_log c "
+                     "on (mm.mailbox=c.mailbox and mm.uid=c.uid) "
+                     "where mm.mailbox=$1 and mm.uid<$2 "
+                     "and c.modseq>=$4 and mm.modseq>=$4" );
 
     d->messages = new Query( msgs, this );
     d->messages->bind( 1, d->mailbox->id() );
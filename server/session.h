@@ -69,6 +69,9 @@ public:
 
     virtual void sendFlagUpdate();
 
+    static void prewarm( Mailbox * );
+    static bool prewarming( Mailbox *, EventHandler * );
+
 private:
     friend class SessionInitialiser;
     class SessionData *d;
@@ -9,6 +9,7 @@
 #include "query.h"
 #include "scope.h"
 #include "sieve.h"
+#include "span.h"
 #include "buffer.h"
 #include "address.h"
 #include "mailbox.h"
@@ -29,7 +30,7 @@ public:
     ManageSieveCommandData()
         : sieve( 0 ), pos( 0 ), done( false ),
           m( 0 ),
-          user( 0 ), t( 0 ), query( 0 ), step( 0 )
+          user( 0 ), t( 0 ), query( 0 ), step( 0 ), span( 0 )
     {}
 
     ManageSieve * sieve;
@@ -48,6 +49,8 @@ public:
     EString ok;
     uint step;
 
+    Span * span;
+
     // for putscript. I think we need subclasses here too.
     Dict<Mailbox> create;
     EString name;
@@ -74,50 +77,54 @@ ManageSieveCommand::ManageSieveCommand( ManageSieve * sieve,
     d->cmd = cmd;
     setLog( new Log );
     Scope x( log() );
+    const char * name = "unknown";
     switch( cmd ) {
     case Authenticate:
-        log( "Executing authenticate command" );
+        name = "authenticate";
         break;
     case StartTls:
-        log( "Executing starttls command" );
+        name = "starttls";
         break;
     case Logout:
-        log( "Executing logout command" );
+        name = "logout";
         break;
     case Capability:
-        log( "Executing capability command" );
+        name = "capability";
         break;
     case HaveSpace:
-        log( "Executing havespace command" );
+        name = "havespace";
         break;
     case PutScript:
-        log( "Executing putscript command" );
+        name = "putscript";
         break;
     case ListScripts:
-        log( "Executing listscripts command" );
+        name = "listscripts";
         break;
     case SetActive:
-        log( "Executing setactive command" );
+        name = "setactive";
         break;
     case GetScript:
-        log( "Executing getscript command" );
+        name = "getscript";
         break;
     case DeleteScript:
-        log( "Executing deletescript command" );
+        name = "deletescript";
         break;
     case RenameScript:
-        log( "Executing renamescript command" );
+        name = "renamescript";
         break;
     case Noop:
-        log( "Executing noop command" );
+        name = "noop";
         break;
     case XAoxExplain:
-        log( "Executing xaoxexplain command" );
+        name = "xaoxexplain";
         break;
     case Unknown:
-        log( "Executing unknown command" );
+        name = "unknown";
         break;
     }
+    log( EString( "Executing " ) + name + " command" );
+    d->span = new Span( log(), EString( "ManageSieve " ) + name );
+    d->span->enter( "execute" );
 }
 
 
@@ -239,6 +246,7 @@ void ManageSieveCommand::execute()
         }
         d->sieve->enqueue( "\r\n" );
     };
+    d->span->finish();
     d->sieve->runCommands();
 }
 
@@ -453,6 +461,7 @@ bool ManageSieveCommand::putScript()
         d->query->bind( 2, d->name );
         d->query->bind( 3, d->script );
         d->t->enqueue( d->query );
+        d->t->enqueue( new Query( "notify scripts_updated", 0 ) );
 
         d->step = 1;
         d->t->commit();
@@ -556,6 +565,7 @@ bool ManageSieveCommand::setActive()
             d->t->enqueue( q );
             log( "Activating script " + r->getEString( "name" ) );
         }
+        d->t->enqueue( new Query( "notify scripts_updated", 0 ) );
         d->t->commit();
     }
 
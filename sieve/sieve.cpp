@@ -2,10 +2,13 @@
 
 #include "sieve.h"
 
+#include "map.h"
 #include "md5.h"
 #include "utf.h"
 #include "date.h"
+#include "dict.h"
 #include "html.h"
+#include "cache.h"
 #include "user.h"
 #include "codec.h"
 #include "query.h"
@@ -15,6 +18,7 @@
 #include "message.h"
 #include "bodypart.h"
 #include "injector.h"
+#include "dbsignal.h"
 #include "collation.h"
 #include "mimefields.h"
 #include "estringlist.h"
@@ -28,6 +32,8 @@
 #include "configuration.h"
 #include "sieveproduction.h"
 
+#include <time.h> // time()
+
 
 class SieveData
     : public Garbage
@@ -44,7 +50,8 @@ public:
           transaction( 0 ),
           injector( 0 ),
           vacations( 0 ),
-          softError( false )
+          softError( false ),
+          lookup( 0 ), batch( 0 )
     {}
 
     class Recipient
@@ -77,7 +84,10 @@ public:
         User * user;
         EventHandler * handler;
         UStringList flags;
+        UString localpart;
+        UString domain;
 
+        void resolve( List<Row> * );
         bool evaluate( SieveCommand * );
         enum Result { True, False, Undecidable };
         Result evaluate( SieveTest * );
@@ -98,7 +108,14 @@ public:
     List<SieveAction> * vacations;
     bool softError;
 
+    Query * lookup;
+    Query * batch;
+    UStringList batchLocalparts;
+    UStringList batchDomains;
+    Dict<Recipient> batchKeys;
+
     Recipient * recipient( Address * a );
+    void lookUp();
 };
 
 
@@ -128,6 +145,200 @@ SieveData::Recipient * SieveData::recipient( Address * a )
 }
 
 
+class SieveScriptCache
+    : public Cache
+{
+public:
+    SieveScriptCache(): Cache( 5 ) {}
+    void clear() { scripts.clear(); }
+
+    class Entry
+        : public Garbage
+    {
+    public:
+        Entry(): script( 0 ) {}
+        EString text;
+        SieveScript * script;
+    };
+
+    Map<Entry> scripts;
+};
+
+static SieveScriptCache * scriptCache = 0;
+
+
+/*! Returns a parsed SieveScript for the script with database ID \a id
+    and source \a text. Delivering to many users parses each active
+    script only once: the parsed script is kept and reused as long as
+    its text is unchanged, so neither PUTSCRIPT on another server nor
+    SETACTIVE can cause a stale script to be evaluated.
+
+    Recipients share the parse tree, so evaluation mustn't leave
+    anything in it. The argument lookups done while evaluating repeat
+    those done while parsing, so they find the productions already
+    marked as parsed (and any errors already recorded). Notify methods
+    created while evaluating keep their errors to themselves.
+*/
+
+static SieveScript * parsedScript( uint id, const EString & text )
+{
+    if ( !scriptCache )
+        scriptCache = new SieveScriptCache;
+    SieveScriptCache::Entry * e = scriptCache->scripts.find( id );
+    if ( e && e->text == text )
+        return e->script;
+
+    e = new SieveScriptCache::Entry;
+    e->text = text;
+    e->script = new SieveScript;
+    e->script->parse( text.crlf() );
+    scriptCache->scripts.insert( id, e );
+    return e->script;
+}
+
+
+class AliasCache
+    : public Cache
+{
+public:
+    class X: public EventHandler {
+    public:
+        X( AliasCache * ac ): me( ac ) {
+            (void)new DatabaseSignal( "scripts_updated", this );
+        }
+        void execute() {
+            me->aliases.clear();
+        }
+        AliasCache * me;
+    };
+    AliasCache(): Cache( 5 ) { (void)new X( this ); }
+    void clear() { aliases.clear(); }
+
+    class Entry
+        : public Garbage
+    {
+    public:
+        Entry(): rows( 0 ), expires( 0 ) {}
+        List<Row> * rows;
+        uint expires;
+    };
+
+    Dict<Entry> aliases;
+};
+
+static AliasCache * aliasCache = 0;
+
+
+/*! Returns the key used to look up \a localpart@\a domain in the
+    alias cache. Addresses are compared case-insensitively, as the
+    database does.
+*/
+
+static EString aliasKey( const UString & localpart, const UString & domain )
+{
+    return localpart.titlecased().utf8() + "@" + domain.titlecased().utf8();
+}
+
+
+/*! Records that looking up the alias \a key returned \a rows, which
+    may be empty. The information is kept for a few seconds, which is
+    long enough to cover a burst of RCPT TO commands or several
+    messages sent to the same list, but short enough that changes to
+    aliases take effect almost at once. ManageSieve sends a
+    scripts_updated notification when it changes a script, and that
+    clears the cache at once.
+*/
+
+static void rememberAlias( const EString & key, List<Row> * rows )
+{
+    if ( !aliasCache )
+        aliasCache = new AliasCache;
+    AliasCache::Entry * e = new AliasCache::Entry;
+    e->rows = rows;
+    e->expires = (uint)time( 0 ) + 10;
+    aliasCache->aliases.insert( key, e );
+}
+
+
+/*! Returns the rows remembered for the alias \a key, or a null pointer
+    if nothing is known about it.
+*/
+
+static List<Row> * rememberedAlias( const EString & key )
+{
+    if ( !aliasCache )
+        return 0;
+    AliasCache::Entry * e = aliasCache->aliases.find( key );
+    if ( !e || e->expires < (uint)time( 0 ) )
+        return 0;
+    return e->rows;
+}
+
+
+/*! Sends the query that looks up all recipients added since the last
+    one was sent.
+*/
+
+void SieveData::lookUp()
+{
+    batch->bind( 1, batchLocalparts );
+    batch->bind( 2, batchDomains );
+    batch->execute();
+    lookup = batch;
+    batch = 0;
+    batchLocalparts.clear();
+    batchDomains.clear();
+    batchKeys.clear();
+}
+
+
+/*! Sets up this recipient (and perhaps others for the same address)
+    from the alias lookup results in \a rows. If \a rows is empty the
+    address isn't local.
+*/
+
+void SieveData::Recipient::resolve( List<Row> * rows )
+{
+    Recipient * in = this;
+    List<Row>::Iterator r( rows );
+    while ( r ) {
+        if ( !r->isNull( "mailbox" ) )
+            in->mailbox = Mailbox::find( r->getInt( "mailbox" ) );
+        if ( !r->isNull( "script" ) ) {
+            in->prefix = r->getUString( "namespace" ) + "/" +
+                         r->getUString( "login" ) + "/";
+            in->user = new User;
+            in->user->setLogin( r->getUString( "login" ) );
+            in->user->setId( r->getInt( "userid" ) );
+            in->user->setAddress( new Address( r->getUString( "name" ),
+                                               r->getEString( "localpart" ),
+                                               r->getEString( "domain" ) ) );
+            in->script = parsedScript( r->getInt( "scriptid" ),
+                                       r->getEString( "script" ) );
+            EString errors = in->script->parseErrors();
+            if ( !errors.isEmpty() ) {
+                ::log( "Note: Sieve script for " +
+                       in->user->login().utf8() +
+                       "had parse errors.", Log::Error );
+                EStringList::Iterator i( EStringList::split( '\n', errors ) );
+                while ( i ) {
+                    ::log( "Sieve: " + *i, Log::Error );
+                    ++i;
+                }
+            }
+            List<SieveCommand>::Iterator c( in->script->topLevelCommands() );
+            while ( c ) {
+                in->pending.append( c );
+                ++c;
+            }
+        }
+        ++r;
+        if ( r )
+            in = new Recipient( address, 0, d );
+    }
+}
+
+
 /*! \class Sieve sieve.h
 
     The Sieve class interprets the Sieve language, which processes
@@ -166,57 +377,43 @@ void Sieve::execute()
     // 0: find the data needed for evaluate().
     if ( d->state == 0 ) {
         bool wasReady = ready();
-        List<SieveData::Recipient>::Iterator i( d->recipients );
-        while ( i ) {
-            if ( i->sq && i->sq->hasResults() ) {
-                Row * r;
-                SieveData::Recipient *in = i;
-                for ( in = i ;
-                      (r = i->sq->nextRow()) ;
-                      in = new SieveData::Recipient( i->address, 0, d) ) {
-                    if ( !r->isNull( "mailbox" ) )
-                        in->mailbox = Mailbox::find( r->getInt( "mailbox" ) );
-                    if ( !r->isNull( "script" ) ) {
-                        in->prefix = r->getUString( "namespace" ) + "/" +
-                                    r->getUString( "login" ) + "/";
-                        in->user = new User;
-                        in->user->setLogin( r->getUString( "login" ) );
-                        in->user->setId( r->getInt( "userid" ) );
-                        in->user->setAddress( new Address(
-                                                 r->getUString( "name" ),
-                                                 r->getEString( "localpart" ),
-                                                 r->getEString( "domain" ) ) );
-                        in->script->parse( r->getEString( "script" ).crlf() );
-                        EString errors = in->script->parseErrors();
-                        if ( !errors.isEmpty() ) {
-                            log( "Note: Sieve script for " +
-                                 in->user->login().utf8() +
-                                 "had parse errors.", Log::Error );
-                            EString prefix = "Sieve script for " +
-                                            in->user->login().utf8();
-                            EStringList::Iterator i(
-                                EStringList::split( '\n', errors ) );
-                            while ( i ) {
-                                log( "Sieve: " + *i, Log::Error );
-                                ++i;
-                            }
-                        }
-                        List<SieveCommand>::Iterator
-                            c(in->script->topLevelCommands());
-                        while ( c ) {
-                            in->pending.append( c );
-                            ++c;
-                        }
+        if ( d->lookup && d->lookup->done() ) {
+            Query * q = d->lookup;
+            d->lookup = 0;
+            Dict< List<Row> > rows;
+            while ( q->hasResults() ) {
+                Row * r = q->nextRow();
+                EString k = aliasKey( r->getUString( "lp" ),
+                                      r->getUString( "dom" ) );
+                List<Row> * l = rows.find( k );
+                if ( !l ) {
+                    l = new List<Row>;
+                    rows.insert( k, l );
+                }
+                l->append( r );
+            }
+            List<SieveData::Recipient>::Iterator i( d->recipients );
+            while ( i ) {
+                SieveData::Recipient * r = i;
+                ++i;
+                if ( r->sq == q ) {
+                    r->sq = 0;
+                    EString k = aliasKey( r->localpart, r->domain );
+                    List<Row> * l = rows.find( k );
+                    if ( !l ) {
+                        l = new List<Row>;
+                        rows.insert( k, l );
                     }
+                    if ( !q->failed() )
+                        rememberAlias( k, l );
+                    r->resolve( l );
                 }
-                i->sq = 0;
             }
-            if ( i->sq && i->sq->done() )
-                i->sq = 0;
-            ++i;
+            if ( d->batch )
+                d->lookUp();
         }
         if ( ready() && !wasReady ) {
-            i = d->recipients.first();
+            List<SieveData::Recipient>::Iterator i( d->recipients );
             while ( i ) {
                 EventHandler * h = i->handler;
                 i->handler = 0;
@@ -471,6 +668,11 @@ void Sieve::addRecipient( Address * address, Mailbox * destination,
 
     If \a address is not a registered alias, Sieve will refuse mail to
     it.
+
+    Recipients added while a lookup is running are looked up together
+    by a single query when it finishes, and recent results are reused
+    for a few seconds, so that a message to many local recipients
+    needs only a few queries.
 */
 
 void Sieve::addRecipient( Address * address, EventHandler * user )
@@ -483,18 +685,6 @@ void Sieve::addRecipient( Address * address, EventHandler * user )
 
     r->handler = user;
 
-    r->sq = new Query( "select al.mailbox, s.script, m.owner, "
-                       "n.name as namespace, u.id as userid, u.login, "
-                       "a.name, a.localpart::text, a.domain::text "
-                       "from aliases al "
-                       "join addresses a on (al.address=a.id) "
-                       "join mailboxes m on (al.mailbox=m.id) "
-                       "left join scripts s on "
-                       " (s.owner=m.owner and s.active='t') "
-                       "left join users u on (s.owner=u.id) "
-                       "left join namespaces n on (u.parentspace=n.id) "
-                       "where m.deleted='f' and "
-                       "a.localpart=$1 and a.domain=$2", this );
     UString localpart( address->localpart() );
     if ( Configuration::toggle( Configuration::UseSubaddressing ) ) {
         EString sep( Configuration::text( Configuration::AddressSeparator ) );
@@ -516,9 +706,44 @@ void Sieve::addRecipient( Address * address, EventHandler * user )
                 localpart = localpart.mid( 0, n );
         }
     }
-    r->sq->bind( 1, localpart );
-    r->sq->bind( 2, address->domain() );
-    r->sq->execute();
+    r->localpart = localpart;
+    r->domain = address->domain();
+
+    EString key = aliasKey( r->localpart, r->domain );
+    List<Row> * rows = rememberedAlias( key );
+    if ( rows ) {
+        r->resolve( rows );
+        if ( ready() )
+            r->handler = 0;
+        return;
+    }
+
+    // while one lookup is running, further recipients are collected
+    // and looked up together when it finishes.
+    if ( !d->batch )
+        d->batch = new Query(
+            "select w.lp, w.dom, al.mailbox, s.id as scriptid, s.script, "
+            "m.owner, n.name as namespace, u.id as userid, u.login, "
+            "a.name, a.localpart::text, a.domain::text "
+            "from (select ($1::text[])[i] as lp, ($2::text[])[i] as dom "
+            "from generate_subscripts($1::text[],1) i) w "
+            "join addresses a on "
+            " (a.localpart=w.lp::citext and a.domain=w.dom::citext) "
+            "join aliases al on (al.address=a.id) "
+            "join mailboxes m on (al.mailbox=m.id) "
+            "left join scripts s on "
+            " (s.owner=m.owner and s.active='t') "
+            "left join users u on (s.owner=u.id) "
+            "left join namespaces n on (u.parentspace=n.id) "
+            "where m.deleted='f'", this );
+    r->sq = d->batch;
+    if ( !d->batchKeys.contains( key ) ) {
+        d->batchKeys.insert( key, r );
+        d->batchLocalparts.append( r->localpart );
+        d->batchDomains.append( r->domain );
+    }
+    if ( !d->lookup )
+        d->lookUp();
 }
 
 
@@ -1049,12 +1274,13 @@ bool SieveData::Recipient::evaluate( SieveCommand * c )
         }
     }
     else if ( c->identifier() == "notify" ) {
+        // the script is shared, so errors stay in m
         SieveNotifyMethod * m
             = new SieveNotifyMethod( c->arguments()->takeString( 1 ),
-                                     0, c );
+                                     0, 0 );
         m->setOwner( address );
         if ( c->arguments()->findTag( ":from" ) )
-            m->setFrom( c->arguments()->takeTaggedString( ":from" ), c );
+            m->setFrom( c->arguments()->takeTaggedString( ":from" ), 0 );
         else
             m->setFrom( address );
 
@@ -1063,7 +1289,7 @@ bool SieveData::Recipient::evaluate( SieveCommand * c )
         // we have no use for :options
 
         if ( c->arguments()->findTag( ":message" ) ) {
-            m->setMessage( c->arguments()->takeTaggedString( ":message" ), c );
+            m->setMessage( c->arguments()->takeTaggedString( ":message" ), 0 );
         }
         else {
             UString b;
@@ -1107,7 +1333,7 @@ bool SieveData::Recipient::evaluate( SieveCommand * c )
                     b.append( "\r\n" );
                 }
             }
-            m->setMessage( b, c );
+            m->setMessage( b, 0 );
         }
 
         SieveAction * a = new SieveAction( SieveAction::MailtoNotification );
@@ -1501,7 +1727,7 @@ SieveData::Recipient::Result SieveData::Recipient::evaluate( SieveTest * t )
     else if ( t->identifier() == "valid_method_method" ) {
         UStringList::Iterator i( t->arguments()->takeStringList( 1 ) );
         while ( i ) {
-            SieveNotifyMethod * m = new SieveNotifyMethod( *i, 0, t );
+            SieveNotifyMethod * m = new SieveNotifyMethod( *i, 0, 0 );
             if ( !m->valid() )
                 return False;
             ++i;
@@ -1513,7 +1739,7 @@ SieveData::Recipient::Result SieveData::Recipient::evaluate( SieveTest * t )
         if ( capa != "ONLINE" )
             return False;
         SieveNotifyMethod * m
-            = new SieveNotifyMethod( t->arguments()->takeString( 1 ), 0, t );
+            = new SieveNotifyMethod( t->arguments()->takeString( 1 ), 0, 0 );
         UString hack;
         switch( m->reachability() ) {
         case SieveNotifyMethod::Immediate:
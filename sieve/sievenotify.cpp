@@ -37,8 +37,7 @@ public:
     // if the type is Mailto
     Header * header;
 
-
-
+    EString error;
 };
 
 
@@ -59,7 +58,8 @@ public:
     \a url.
 
     Reports errors using \a argument if that is non-null, otherwise
-    using \a command.
+    using \a command. If both are null, errors are only recorded in
+    this object, and error() returns the first.
 */
 
 SieveNotifyMethod::SieveNotifyMethod( const UString & url,
@@ -125,19 +125,31 @@ SieveNotifyMethod::SieveNotifyMethod( const UString & url,
 
 
 /*! Reports the error \a e via \a p if supplied, otherwise via the
-    command().
-
+    command(). If there is no command() either, \a e is only recorded
+    for error().
 */
 
 void SieveNotifyMethod::reportError( const EString & e, SieveProduction * p )
 {
+    if ( d->error.isEmpty() )
+        d->error = e;
     if ( p )
         p->setError( e );
-    else
+    else if ( d->command )
         d->command->setError( e );
 }
 
 
+/*! Returns the first error reported by this object, or an empty
+    string if there hasn't been any.
+*/
+
+EString SieveNotifyMethod::error() const
+{
+    return d->error;
+}
+
+
 /*! Returns the command argument to the constructor. */
 
 SieveProduction * SieveNotifyMethod::command() const
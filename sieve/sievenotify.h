@@ -24,6 +24,7 @@ public:
     class SieveProduction * command() const;
 
     bool valid();
+    EString error() const;
 
     enum Type {
         Mailto,
@@ -26,7 +26,8 @@ class DeliveryAgentData
 public:
     DeliveryAgentData()
         : messageId( 0 ), t( 0 ),
-          qm( 0 ), qs( 0 ), qr( 0 ), message( 0 ), expired( false ),
+          qm( 0 ), qs( 0 ), qr( 0 ), message( 0 ), fetcher( 0 ),
+          expired( false ),
           dsn( 0 ), injector( 0 ), update( 0 ), client( 0 ),
           updatedDelivery( false )
     {}
@@ -37,6 +38,7 @@ public:
     Query * qs;
     Query * qr;
     Message * message;
+    Fetcher * fetcher;
     uint deliveryId;
     bool expired;
     DSN * dsn;
@@ -140,6 +142,13 @@ void DeliveryAgent::execute()
         if ( !d->qs->done() || !d->qr->done() )
             return;
 
+        if ( d->fetcher && d->fetcher->failed() ) {
+            d->t->rollback();
+            d->messageId = 0;
+            log( "Could not fetch message; aborting", Log::Error );
+            return;
+        }
+
         if ( !( d->message->hasHeaders() &&
                 d->message->hasAddresses() &&
                 d->message->hasBodies() ) )
@@ -237,6 +246,7 @@ Message * DeliveryAgent::fetchMessage( uint messageId )
     Message * m = new Message;
     m->setDatabaseId( messageId );
     Fetcher * f = new Fetcher( m, this );
+    d->fetcher = f;
     f->fetch( Fetcher::Addresses );
     f->fetch( Fetcher::OtherHeader );
     f->fetch( Fetcher::Body );
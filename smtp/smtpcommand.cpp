@@ -8,6 +8,7 @@
 #include "smtpauth.h"
 
 #include "smtpparser.h"
+#include "span.h"
 #include "estringlist.h"
 #include "eventloop.h"
 #include "scope.h"
@@ -20,13 +21,14 @@ class SmtpCommandData
 public:
     SmtpCommandData()
         : responseCode( 200 ), enhancedCode( 0 ),
-          done( false ), smtp( 0 ) {}
+          done( false ), smtp( 0 ), span( 0 ) {}
 
     uint responseCode;
     const char * enhancedCode;
     EStringList response;
     bool done;
     SMTP * smtp;
+    Span * span;
 };
 
 
@@ -57,6 +59,8 @@ SmtpCommand::SmtpCommand( class SMTP * s )
 void SmtpCommand::finish()
 {
     d->done = true;
+    if ( d->span )
+        d->span->enter( "queue" );
     d->smtp->execute();
 }
 
@@ -79,8 +83,11 @@ bool SmtpCommand::done() const
 
 void SmtpCommand::emitResponses()
 {
-    if ( !d->responseCode )
+    if ( !d->responseCode ) {
+        if ( d->done && d->span )
+            d->span->finish();
         return;
+    }
 
     Scope x( log() );
     EString r;
@@ -112,6 +119,8 @@ void SmtpCommand::emitResponses()
     server()->enqueue( r );
     d->responseCode = 0;
     d->response.clear();
+    if ( d->done && d->span )
+        d->span->finish();
 }
 
 
@@ -220,6 +229,8 @@ SmtpCommand * SmtpCommand::create( SMTP * server, const EString & command )
 
     Scope x( r->log() );
     r->log( "Command: " + command.simplified(), Log::Debug );
+    r->d->span = new Span( r->log(), "SMTP " + c.upper() );
+    r->d->span->enter( "execute" );
 
     if ( !r->done() && r->d->responseCode < 400 && !p->error().isEmpty() )
         r->respond( 501, p->error(), "5.5.2" );